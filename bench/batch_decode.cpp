@@ -0,0 +1,96 @@
+/*
+Check and benchmark of BatchDecoder, kept out of the main binary :
+
+  g++ -std=c++20 -O2 -pthread bench/batch_decode.cpp -o batch_decode
+  ./batch_decode <input> [record size, default 4096]
+
+The input is compressed as the main binary does, the decoder is loaded from
+the header of that file, and the input is cut in records each encoded alone
+with the header table. The batch must give every record back, then with its
+last byte dropped every record must be reported as failed. Exit code 0 when
+both hold.
+*/
+#include "../stream/batch_decode.hpp"
+#include "../stream/compression.hpp"
+#include <chrono>
+#include <fstream>
+#include <iostream>
+#include <iterator>
+#include <sstream>
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    std::cout << "usage : " << argv[0] << " <input> [record size]"
+              << std::endl;
+    return 2;
+  }
+  size_t record_size = argc > 2 ? std::strtoull(argv[2], nullptr, 10) : 4096;
+  record_size = std::max<size_t>(record_size, 1);
+
+  std::ifstream file(argv[1], std::ios::binary);
+  std::string data(std::istreambuf_iterator<char>(file), {});
+
+  // A real compressed file, whose header the decoder is loaded from
+  auto compressed = std::make_shared<std::stringstream>();
+  auto c = Compressor<char>(std::make_shared<std::istringstream>(data));
+  c.set_output(compressed);
+  c.run();
+
+  compressed->seekg(0);
+  auto decoder = BatchDecoder::from_header(compressed);
+  if (!decoder) {
+    std::cout << "Cannot load the table of the header" << std::endl;
+    return 1;
+  }
+
+  // The encoder side reads the same table
+  compressed->seekg(0);
+  read_magic(*compressed);
+  read_u64(*compressed);
+  compressed->get();
+  auto codes = BatchDecoder::_codes(*deserialize_preorder<char>(compressed));
+  unsigned max_len = 1;
+  for (auto entry : codes)
+    max_len = std::max(max_len, code_len(entry));
+
+  auto in = reinterpret_cast<const uint8_t *>(data.data());
+  size_t record_n = (data.size() + record_size - 1) / record_size;
+  std::vector<std::vector<uint8_t>> encoded(record_n), decoded(record_n);
+  std::vector<batch_span> spans(record_n);
+  size_t encoded_size = 0;
+  for (size_t r = 0; r < record_n; r++) {
+    size_t n = std::min(record_size, data.size() - r * record_size);
+    // Every code takes at most max_len bits, encode() stores 8 bytes past
+    encoded[r].resize(n * max_len / 8 + 1 + sizeof(uint64_t));
+    size_t size = encode(in + r * record_size, n, encoded[r].data(), codes,
+                         max_len);
+    encoded[r].resize(size);
+    encoded_size += size;
+    decoded[r].resize(n);
+    spans[r] = {encoded[r].data(), size, decoded[r].data(), n};
+  }
+
+  auto start = std::chrono::steady_clock::now();
+  size_t ok_n = decoder->decode(spans.data(), record_n);
+  double seconds =
+      std::chrono::duration<double>(std::chrono::steady_clock::now() - start)
+          .count();
+
+  size_t intact_n = 0;
+  for (size_t r = 0; r < record_n; r++)
+    intact_n += spans[r].ok && std::equal(decoded[r].begin(), decoded[r].end(),
+                                          in + r * record_size);
+  std::cout << record_n << " records, " << encoded_size << " B coded : "
+            << ok_n << " decoded, " << intact_n << " intact, "
+            << (seconds ? data.size() / seconds / (1 << 20) : 0) << " MB/s"
+            << std::endl;
+
+  // A record is at least one byte, its last byte holds at least one code bit
+  for (auto &span : spans)
+    span.in_size--;
+  size_t truncated_ok_n = decoder->decode(spans.data(), record_n);
+  std::cout << "Truncated records : " << truncated_ok_n << " decoded"
+            << std::endl;
+
+  return ok_n == record_n && intact_n == record_n && !truncated_ok_n ? 0 : 1;
+}
@@ -0,0 +1,58 @@
+#pragma once
+#include "../utils/log.h"
+#include <condition_variable>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <stack>
+
+/*
+Fixed size pool of buffers. Buffers are allocated lazily until `capacity` is
+reached, after that `acquire` blocks until a buffer is given back with
+`release`. This is what bounds the number of chunks in flight between the
+reader and the writer.
+
+`allocate`, when given, makes the buffers instead of make_shared, e.g. to
+first touch them on a NUMA node.
+*/
+template <typename Data> class BufferPool {
+  size_t capacity;
+  size_t buffer_size;
+  size_t allocated = 0;
+  std::function<std::shared_ptr<Data[]>(size_t)> allocate;
+
+  std::mutex m;
+  std::condition_variable cv;
+  std::stack<std::shared_ptr<Data[]>> free_buffers;
+
+public:
+  BufferPool(size_t capacity, size_t buffer_s,
+             std::function<std::shared_ptr<Data[]>(size_t)> allocate = nullptr)
+      : capacity(capacity), buffer_size(buffer_s), allocate(allocate) {}
+
+  std::shared_ptr<Data[]> acquire() {
+    std::unique_lock lk(m);
+    if (free_buffers.empty() && allocated < capacity) {
+      // Reserve the slot, then allocate unlocked : a first touch on another
+      // node must not stall the workers releasing buffers
+      allocated++;
+      DEBUG("Allocated pool buffer : " << allocated << "/" << capacity);
+      lk.unlock();
+      return allocate ? allocate(buffer_size)
+                      : std::make_shared<Data[]>(buffer_size);
+    }
+    if (free_buffers.empty()) {
+      DEBUG("Pool exhausted : waiting for a buffer to be released");
+    }
+    cv.wait(lk, [this]() { return !free_buffers.empty(); });
+    auto buffer = free_buffers.top();
+    free_buffers.pop();
+    return buffer;
+  }
+
+  void release(std::shared_ptr<Data[]> buffer) {
+    std::unique_lock lk(m);
+    free_buffers.push(buffer);
+    cv.notify_one();
+  }
+};
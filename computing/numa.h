@@ -0,0 +1,98 @@
+#pragma once
+#include "../utils/log.h"
+#include "topology.h"
+#include <algorithm>
+#include <memory>
+#include <thread>
+#include <vector>
+
+#ifdef __linux__
+#include <pthread.h>
+#include <sched.h>
+#endif
+
+/*
+Where the workers of a dispatcher run. Worker `id` belongs to node
+`id % node_n` and is pinned to one core of that node, consecutive workers of a
+node taking its cores in turn. Only the cores the process is allowed on are
+used, nodes left without one are dropped.
+
+An empty placement (the default) leaves the scheduler free.
+*/
+struct NumaPlacement {
+  std::vector<std::vector<int>> node_cpus;
+
+  NumaPlacement() = default;
+
+  NumaPlacement(const Topology &topology) {
+    std::vector<int> allowed = _allowed_cpus();
+    for (auto &cpus : topology.node_cpus) {
+      std::vector<int> usable;
+      for (auto cpu : cpus)
+        if (allowed.empty() ||
+            std::find(allowed.begin(), allowed.end(), cpu) != allowed.end())
+          usable.push_back(cpu);
+      if (usable.size())
+        node_cpus.push_back(usable);
+    }
+    // No node directory : one node of every allowed cpu
+    if (node_cpus.empty() && allowed.size())
+      node_cpus.push_back(allowed);
+  }
+
+  bool enabled() const { return !node_cpus.empty(); }
+  int node_n() const { return std::max<int>(node_cpus.size(), 1); }
+  int node_of(int worker_id) const { return worker_id % node_n(); }
+
+  std::vector<int> cpus_of(int worker_id) const {
+    if (!enabled())
+      return {};
+    auto &cpus = node_cpus[node_of(worker_id)];
+    return {cpus[(worker_id / node_n()) % cpus.size()]};
+  }
+
+  static std::vector<int> _allowed_cpus() {
+    std::vector<int> cpus;
+#ifdef __linux__
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    if (sched_getaffinity(0, sizeof(set), &set) == 0)
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++)
+        if (CPU_ISSET(cpu, &set))
+          cpus.push_back(cpu);
+#endif
+    return cpus;
+  }
+};
+
+// Restrict the calling thread to `cpus`, a no-op when empty or not on Linux
+inline void pin_thread(const std::vector<int> &cpus) {
+#ifdef __linux__
+  if (cpus.empty())
+    return;
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  for (auto cpu : cpus)
+    CPU_SET(cpu, &set);
+  if (pthread_setaffinity_np(pthread_self(), sizeof(set), &set) != 0) {
+    DEBUG("Cannot pin thread to cpu " << cpus[0]);
+  }
+#endif
+}
+
+/*
+Allocate `n` zeroed elements from a thread pinned to `cpus`. The zeroing is
+the first touch, so with the default local allocation policy the pages land
+on the node of `cpus`.
+*/
+template <typename Data>
+std::shared_ptr<Data[]> allocate_on(const std::vector<int> &cpus, size_t n) {
+  if (cpus.empty())
+    return std::make_shared<Data[]>(n);
+  std::shared_ptr<Data[]> buffer;
+  std::thread([&buffer, &cpus, n]() {
+    pin_thread(cpus);
+    buffer = std::make_shared<Data[]>(n);
+  }).join();
+  return buffer;
+}
@@ -0,0 +1,112 @@
+#pragma once
+#include "../utils/log.h"
+#include <algorithm>
+#include <filesystem>
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+/*
+Machine layout as exposed by sysfs. Every field falls back to a sane default
+when the file is missing (containers, non Linux hosts).
+*/
+struct Topology {
+  int core_n = 1;
+  size_t l2_size = 0;
+  size_t l3_size = 0;
+  // CPUs of every NUMA node, one entry per node
+  std::vector<std::vector<int>> node_cpus;
+
+  int numa_node_n() const { return std::max<int>(node_cpus.size(), 1); }
+
+  // Identifies the machine for the tuning cache
+  std::string signature() const {
+    std::stringstream ss;
+    ss << core_n << "c-" << l2_size << "l2-" << l3_size << "l3-"
+       << numa_node_n() << "n";
+    return ss.str();
+  }
+};
+
+// Parse a sysfs cpu list such as `0-3,8,10-11`
+inline std::vector<int> parse_cpulist(const std::string &list) {
+  std::vector<int> cpus;
+  std::stringstream ss(list);
+  std::string range;
+  while (std::getline(ss, range, ',')) {
+    if (range.empty() || !std::isdigit(range[0]))
+      continue;
+    auto dash = range.find('-');
+    int first = std::stoi(range.substr(0, dash));
+    int last = dash == std::string::npos ? first : std::stoi(range.substr(dash + 1));
+    for (int cpu = first; cpu <= last; cpu++)
+      cpus.push_back(cpu);
+  }
+  return cpus;
+}
+
+// Parse a sysfs cache size such as `1024K`
+inline size_t parse_cache_size(const std::string &size) {
+  char *end;
+  size_t bytes = std::strtoull(size.c_str(), &end, 10);
+  if (*end == 'K')
+    bytes *= 1024;
+  else if (*end == 'M')
+    bytes *= 1024 * 1024;
+  return bytes;
+}
+
+inline std::string read_sysfs(const std::filesystem::path &path) {
+  std::ifstream file(path);
+  std::string value;
+  std::getline(file, value);
+  return value;
+}
+
+inline Topology read_topology() {
+  namespace fs = std::filesystem;
+  Topology topology;
+  std::error_code ec;
+
+  auto online = parse_cpulist(read_sysfs("/sys/devices/system/cpu/online"));
+  topology.core_n = online.size() ? online.size()
+                                  : std::max(1u, std::thread::hardware_concurrency());
+
+  fs::path caches = "/sys/devices/system/cpu/cpu0/cache";
+  if (fs::is_directory(caches, ec)) {
+    for (auto &index : fs::directory_iterator(caches, ec)) {
+      if (index.path().filename().string().rfind("index", 0) != 0)
+        continue;
+      if (read_sysfs(index.path() / "type") == "Instruction")
+        continue;
+      auto level = read_sysfs(index.path() / "level");
+      auto size = parse_cache_size(read_sysfs(index.path() / "size"));
+      if (level == "2")
+        topology.l2_size = size;
+      else if (level == "3")
+        topology.l3_size = size;
+    }
+  }
+
+  fs::path nodes = "/sys/devices/system/node";
+  if (fs::is_directory(nodes, ec)) {
+    std::vector<std::pair<int, std::vector<int>>> found;
+    for (auto &node : fs::directory_iterator(nodes, ec)) {
+      auto name = node.path().filename().string();
+      if (name.rfind("node", 0) != 0 || name.size() == 4 ||
+          !std::isdigit(name[4]))
+        continue;
+      auto cpus = parse_cpulist(read_sysfs(node.path() / "cpulist"));
+      if (cpus.size())
+        found.push_back({std::stoi(name.substr(4)), cpus});
+    }
+    std::sort(found.begin(), found.end());
+    for (auto &node : found)
+      topology.node_cpus.push_back(node.second);
+  }
+
+  DEBUG("Topology : " << topology.signature());
+  return topology;
+}
@@ -0,0 +1,177 @@
+#pragma once
+#include "../utils/log.h"
+#include "topology.h"
+#include "worker.h"
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdlib>
+#include <filesystem>
+#include <fstream>
+#include <functional>
+#include <set>
+#include <string>
+
+// Parallelization parameters of one pipeline stage
+struct StageProfile {
+  size_t chunk_size = 1000000;
+  int worker_n = LoadDispatcher<char>::DEFAULT_MAX_WORKER_N;
+};
+
+struct TuningProfile {
+  StageProfile frequency;
+  StageProfile write;
+};
+
+/*
+Picks chunk size and worker count of every stage. Candidates are derived from
+the cache sizes and the core count, each one is timed on a sample of the input
+and the fastest wins. Chunk size is tuned first with one worker per core, then
+the worker count with the winning chunk size.
+
+The write chunk is also the block size of the file, tuning it for speed would
+make the output differ from one machine to the next : that stage keeps its
+chunk size and only tunes the worker count.
+
+Results are cached on disk per machine signature so calibration only runs once.
+*/
+class Autotuner {
+  Topology topology;
+
+public:
+  static constexpr size_t MIN_CHUNK_SIZE = 64 * 1024;
+  static constexpr size_t MAX_CHUNK_SIZE = 16 * 1024 * 1024;
+
+  // Runs a stage on the sample with the given profile
+  using stage_runner = std::function<void(const StageProfile &)>;
+
+  Autotuner(const Topology &topology) : topology(topology) {}
+
+  // `max_chunk` is the largest chunk the memory limit holds
+  std::vector<size_t> chunk_candidates(size_t sample_size,
+                                       size_t max_chunk = SIZE_MAX) const {
+    std::set<size_t> candidates = {1000000, 4 * 1024 * 1024};
+    if (topology.l2_size)
+      candidates.insert(topology.l2_size);
+    if (topology.l3_size)
+      candidates.insert(topology.l3_size / topology.core_n);
+
+    // Every worker needs at least one chunk of the sample
+    max_chunk = std::min({max_chunk, MAX_CHUNK_SIZE,
+                          std::max(MIN_CHUNK_SIZE, sample_size / topology.core_n)});
+    std::vector<size_t> clamped;
+    for (auto c : candidates)
+      clamped.push_back(
+          std::clamp(c, MIN_CHUNK_SIZE, std::max(MIN_CHUNK_SIZE, max_chunk)));
+    clamped.erase(std::unique(clamped.begin(), clamped.end()), clamped.end());
+    return clamped;
+  }
+
+  std::vector<int> worker_candidates() const {
+    std::set<int> candidates = {std::max(2, topology.core_n / 2),
+                                std::max(2, topology.core_n),
+                                std::max(2, topology.core_n + topology.core_n / 2)};
+    return std::vector<int>(candidates.begin(), candidates.end());
+  }
+
+  static uint64_t time(const stage_runner &run, const StageProfile &profile) {
+    auto start = std::chrono::steady_clock::now();
+    run(profile);
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration_cast<std::chrono::microseconds>(end - start)
+        .count();
+  }
+
+  StageProfile calibrate_stage(const std::string &name, const stage_runner &run,
+                               size_t sample_size,
+                               size_t max_chunk = SIZE_MAX) const {
+    StageProfile best;
+    best.worker_n = std::max(2, topology.core_n);
+    uint64_t best_time = UINT64_MAX;
+
+    for (auto chunk_size : chunk_candidates(sample_size, max_chunk)) {
+      StageProfile candidate = {chunk_size, best.worker_n};
+      auto t = time(run, candidate);
+      DEBUG("Calibrating " << name << " chunk " << chunk_size << " : " << t
+                           << " [µs]");
+      if (t < best_time) {
+        best_time = t;
+        best.chunk_size = chunk_size;
+      }
+    }
+
+    return calibrate_workers(name, run, best, best_time);
+  }
+
+  // Tune the worker count only, `best` took `best_time` if already timed
+  StageProfile calibrate_workers(const std::string &name,
+                                 const stage_runner &run, StageProfile best,
+                                 uint64_t best_time = UINT64_MAX) const {
+    for (auto worker_n : worker_candidates()) {
+      StageProfile candidate = {best.chunk_size, worker_n};
+      auto t = time(run, candidate);
+      DEBUG("Calibrating " << name << " workers " << worker_n << " : " << t
+                           << " [µs]");
+      if (t < best_time) {
+        best_time = t;
+        best.worker_n = worker_n;
+      }
+    }
+
+    INFO("Tuned " << name << " : chunk " << best.chunk_size << ", "
+                  << best.worker_n << " workers");
+    return best;
+  }
+
+  static std::filesystem::path cache_path() {
+    if (auto xdg = std::getenv("XDG_CACHE_HOME"))
+      return std::filesystem::path(xdg) / "compressor" / "profile";
+    if (auto home = std::getenv("HOME"))
+      return std::filesystem::path(home) / ".cache" / "compressor" / "profile";
+    return {};
+  }
+
+  /*
+  Cache layout, one line per machine :
+  <signature> <frequency chunk> <frequency workers> <write chunk> <write workers>
+  */
+  bool load(TuningProfile &profile) const {
+    std::ifstream file(cache_path());
+    std::string signature;
+    TuningProfile p;
+    while (file >> signature >> p.frequency.chunk_size >> p.frequency.worker_n >>
+           p.write.chunk_size >> p.write.worker_n) {
+      if (signature == topology.signature()) {
+        profile = p;
+        DEBUG("Loaded tuning profile from " << cache_path());
+        return true;
+      }
+    }
+    return false;
+  }
+
+  void save(const TuningProfile &profile) const {
+    auto path = cache_path();
+    if (path.empty())
+      return;
+
+    // Keep profiles of other machines sharing the same home
+    std::vector<std::string> lines;
+    {
+      std::ifstream file(path);
+      std::string line;
+      while (std::getline(file, line))
+        if (line.rfind(topology.signature() + " ", 0) != 0)
+          lines.push_back(line);
+    }
+
+    std::error_code ec;
+    std::filesystem::create_directories(path.parent_path(), ec);
+    std::ofstream file(path, std::ios::trunc);
+    for (auto &line : lines)
+      file << line << "\n";
+    file << topology.signature() << " " << profile.frequency.chunk_size << " "
+         << profile.frequency.worker_n << " " << profile.write.chunk_size << " "
+         << profile.write.worker_n << "\n";
+  }
+};
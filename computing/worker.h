@@ -1,14 +1,19 @@
 #pragma once
 #include "../utils/log.h"
+#include "../utils/telemetry.hpp"
+#include "numa.h"
+#include <algorithm>
 #include <chrono>
 #include <condition_variable>
 #include <memory>
 #include <mutex>
-#include <stack>
 #include <thread>
 #include <unordered_map>
 #include <vector>
 
+// Id of the worker running on this thread, -1 outside of workers
+inline thread_local int current_worker_id = -1;
+
 template <typename T> class SharedRessource {
   std::shared_ptr<std::mutex> m;
   std::shared_ptr<T> resource;
@@ -29,30 +34,38 @@ public:
   worker_id id;
   std::shared_ptr<std::condition_variable> dispatcher_cv;
   std::shared_ptr<std::mutex> dispatcher_m;
-  std::shared_ptr<std::stack<worker_id>> available_workers;
+  std::shared_ptr<std::vector<worker_id>> available_workers;
   std::thread runner;
   std::shared_ptr<Data[]> buffer;
+  // NUMA node and cores of the worker, -1 and empty when not placed
+  int node = -1;
+  std::vector<int> cpus;
 
 public:
   Worker(worker_id id, std::shared_ptr<std::condition_variable> cv,
          std::shared_ptr<std::mutex> m,
-         std::shared_ptr<std::stack<worker_id>> aw)
+         std::shared_ptr<std::vector<worker_id>> aw)
       : id(id), dispatcher_cv(cv), dispatcher_m(m), available_workers(aw) {}
 
-  void __init(size_t buffer_s) { buffer = std::make_unique<Data[]>(buffer_s); }
+  // A placed worker first touches its buffer from its own node
+  void __init(size_t buffer_s) { buffer = allocate_on<Data>(cpus, buffer_s); }
 
   void release() {
     DEBUG("Released worker : " << id);
     std::unique_lock dispatcher_q_lock(*dispatcher_m);
-    available_workers->push(id);
+    available_workers->push_back(id);
     dispatcher_cv->notify_one();
   }
 
   template <typename F, typename... Args> void run(F f, Args... args) {
     // Run callable
+    Telemetry::worker_started();
     runner = std::thread(
         [this, f](Args... args) {
+          current_worker_id = id;
+          pin_thread(cpus);
           f(args...);
+          Telemetry::worker_finished();
           release();
         },
         args...);
@@ -64,7 +77,7 @@ public:
 template <typename Data> class LoadDispatcher {
   using worker_id = typename Worker<Data>::worker_id;
 
-  int max_worker_n = 10;
+  int max_worker_n;
   int worker_n = 0;
   worker_id next_worker_id = 0;
 
@@ -74,16 +87,25 @@ template <typename Data> class LoadDispatcher {
 
   std::shared_ptr<std::condition_variable> dispatcher_cv;
   std::shared_ptr<std::mutex> dispatcher_m;
-  std::shared_ptr<std::stack<worker_id>> available_workers;
+  std::shared_ptr<std::vector<worker_id>> available_workers;
 
   std::unordered_map<worker_id, std::shared_ptr<Worker<Data>>> worker_pool;
 
+  const NumaPlacement *placement;
+  // Node the next chunk goes to, chunks are handed out to the nodes in turn
+  int next_node = 0;
+
 public:
-  LoadDispatcher(int time_before_new_worker_micro, int buffer_s)
-      : buffer_size(buffer_s) {
+  static constexpr int DEFAULT_MAX_WORKER_N = 10;
+
+  LoadDispatcher(int time_before_new_worker_micro, size_t buffer_s,
+                 int max_worker_n = DEFAULT_MAX_WORKER_N,
+                 const NumaPlacement *placement = nullptr)
+      : max_worker_n(max_worker_n), buffer_size(buffer_s),
+        placement(placement && placement->enabled() ? placement : nullptr) {
     dispatcher_m = std::make_shared<std::mutex>();
     dispatcher_cv = std::make_shared<std::condition_variable>();
-    available_workers = std::make_shared<std::stack<worker_id>>();
+    available_workers = std::make_shared<std::vector<worker_id>>();
 
     std::chrono::microseconds us(time_before_new_worker_micro);
     time_before_new_worker = std::chrono::duration<int, std::micro>(us);
@@ -98,9 +120,18 @@ public:
     DEBUG("Joined");
   }
 
+  // Latest released worker, of the node whose turn it is if there is one
   worker_id _pick_worker() {
-    auto worker_id = available_workers->top();
-    available_workers->pop();
+    auto it = std::prev(available_workers->end());
+    if (placement) {
+      auto preferred = std::find_if(
+          available_workers->rbegin(), available_workers->rend(),
+          [this](worker_id id) { return worker_pool.at(id)->node == next_node; });
+      if (preferred != available_workers->rend())
+        it = std::prev(preferred.base());
+    }
+    auto worker_id = *it;
+    available_workers->erase(it);
     worker_pool.at(worker_id)->runner.join();
     return worker_id;
   }
@@ -109,6 +140,10 @@ public:
     auto id = next_worker_id++;
     auto worker = std::make_shared<Worker<Data>>(
         id, dispatcher_cv, dispatcher_m, available_workers);
+    if (placement) {
+      worker->node = placement->node_of(id);
+      worker->cpus = placement->cpus_of(id);
+    }
     DEBUG("Created worker - id = " << worker->id);
     worker->__init(buffer_size);
     worker_pool[id] = worker;
@@ -144,6 +179,8 @@ public:
         }
       }
     }
+    if (placement)
+      next_node = (worker_pool.at(id)->node + 1) % placement->node_n();
     return worker_pool.at(id);
   }
 
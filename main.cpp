@@ -4,6 +4,7 @@
 #include <algorithm>
 #include <array>
 #include <atomic>
+#include <cstring>
 #include <fstream>
 #include <functional>
 #include <istream>
@@ -11,10 +12,40 @@
 #include <thread>
 #include <unistd.h>
 
+// Parse a size such as `512M`, `2G` or `4096` into bytes
+size_t parse_size(const char *arg) {
+  char *end;
+  size_t size = std::strtoull(arg, &end, 10);
+  switch (std::toupper(*end)) {
+  case 'G':
+    size *= 1024;
+    [[fallthrough]];
+  case 'M':
+    size *= 1024;
+    [[fallthrough]];
+  case 'K':
+    size *= 1024;
+  }
+  return size;
+}
+
 int main(int argc, char *argv[]) {
   bool decompress = false;
-  char *infile;
-  char *outfile;
+  char *infile = nullptr;
+  char *outfile = nullptr;
+  size_t memory_limit = 0;
+  bool autotune = true;
+  bool retune = false;
+  size_t chunk_size = 0;
+  int worker_n = 0;
+  double sample_fraction = 1;
+  bool order1 = false;
+  bool adaptive_tables = true;
+  bool analyze = false;
+  bool numa = false;
+  std::string stats_file;
+  std::string stats_socket;
+  int stats_interval = 1000;
 
   for (size_t i = 1; i < argc; i++) {
     if (strcmp(argv[i], "-d") == 0) {
@@ -23,28 +54,122 @@ int main(int argc, char *argv[]) {
       infile = argv[i + 1];
     } else if (strcmp(argv[i], "-o") == 0) {
       outfile = argv[i + 1];
+    } else if (strcmp(argv[i], "--memory-limit") == 0) {
+      memory_limit = parse_size(argv[i + 1]);
+    } else if (strcmp(argv[i], "--sample") == 0) {
+      sample_fraction = std::atof(argv[i + 1]);
+    } else if (strcmp(argv[i], "--perf-counters") == 0) {
+      PerfRegistry::enable();
+    } else if (strcmp(argv[i], "--stats-file") == 0) {
+      stats_file = argv[i + 1];
+    } else if (strcmp(argv[i], "--stats-socket") == 0) {
+      stats_socket = argv[i + 1];
+    } else if (strcmp(argv[i], "--stats-interval") == 0) {
+      stats_interval = std::atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--analyze") == 0) {
+      analyze = true;
+    } else if (strcmp(argv[i], "--single-table") == 0) {
+      adaptive_tables = false;
+    } else if (strcmp(argv[i], "--order1") == 0) {
+      order1 = true;
+    } else if (strcmp(argv[i], "--no-autotune") == 0) {
+      autotune = false;
+    } else if (strcmp(argv[i], "--retune") == 0) {
+      retune = true;
+    } else if (strcmp(argv[i], "--chunk-size") == 0) {
+      chunk_size = parse_size(argv[i + 1]);
+    } else if (strcmp(argv[i], "--workers") == 0) {
+      worker_n = std::atoi(argv[i + 1]);
+    } else if (strcmp(argv[i], "--numa") == 0) {
+      numa = true;
     } else if (strcmp(argv[i], "-h") == 0) {
       std::cout << " -i : Input file " << std::endl;
       std::cout << " -o : Output file " << std::endl;
       std::cout << " -d : Decompress mode" << std::endl;
+      std::cout << " --memory-limit : Max buffer memory, e.g. 64M (compression)"
+                << std::endl;
+      std::cout << " --sample : Build the histogram from this fraction of the "
+                   "input, e.g. 0.1"
+                << std::endl;
+      std::cout << " --perf-counters : Report hardware counters per stage"
+                << std::endl;
+      std::cout << " --stats-file : Rewrite live metrics (Prometheus text) to "
+                   "this file"
+                << std::endl;
+      std::cout << " --stats-socket : Serve live metrics on this Unix socket"
+                << std::endl;
+      std::cout << " --stats-interval : Metrics period in ms, default 1000"
+                << std::endl;
+      std::cout << " --analyze : Report entropy and the exact compressed size "
+                   "without writing anything"
+                << std::endl;
+      std::cout << " --single-table : Never send a new table in a block"
+                << std::endl;
+      std::cout << " --order1 : Code every byte with a table picked by the "
+                   "previous one"
+                << std::endl;
+      std::cout << " --no-autotune : Use default chunk size and worker count"
+                << std::endl;
+      std::cout << " --retune : Recalibrate and overwrite the cached profile"
+                << std::endl;
+      std::cout << " --chunk-size : Chunk size override, e.g. 1M" << std::endl;
+      std::cout << " --workers : Worker count override" << std::endl;
+      std::cout << " --numa : Pin workers to the cores of every NUMA node and "
+                   "keep their buffers on their node"
+                << std::endl;
       return 0;
     }
   }
 
+  if (!stats_file.empty() || !stats_socket.empty())
+    Telemetry::start(stats_file, stats_socket, stats_interval);
+
   auto input =
       static_cast<std::basic_istream<char> *>(new std::ifstream(infile));
-  auto output = static_cast<std::basic_ostream<char> *>(
-      new std::ofstream(outfile, std::ios::binary));
+  // Analysis writes nothing, it needs no output file
+  std::basic_ostream<char> *output = nullptr;
+  if (!analyze)
+    output = static_cast<std::basic_ostream<char> *>(
+        new std::ofstream(outfile, std::ios::binary));
 
   if (decompress) {
     auto a = Inflator<char>(std::shared_ptr<std::basic_istream<char>>(input));
     a.set_output(std::shared_ptr<std::basic_ostream<char>>(output));
+    if (worker_n)
+      a.set_worker_n(worker_n);
+    a.set_numa(numa);
     a.run();
   } else {
     auto c = Compressor<char>(std::shared_ptr<std::basic_istream<char>>(input));
     c.set_output(std::shared_ptr<std::basic_ostream<char>>(output));
-    PROFILE(c.run())
+    c.set_memory_limit(memory_limit);
+    c.set_sample_fraction(sample_fraction);
+    c.set_order1(order1);
+    c.set_adaptive_tables(adaptive_tables);
+    c.set_numa(numa);
+    // An analysis uses the cached profile but never calibrates one
+    if (autotune && analyze)
+      c.load_profile();
+    else if (autotune)
+      PROFILE(c.autotune(retune))
+
+    auto profile = c.get_profile();
+    for (auto stage : {&profile.frequency, &profile.write}) {
+      if (chunk_size)
+        stage->chunk_size = chunk_size;
+      if (worker_n)
+        stage->worker_n = worker_n;
+    }
+    c.set_profile(profile);
+    if (analyze) {
+      PROFILE(c.analyze())
+    } else {
+      PROFILE(c.run())
+    }
   }
 
+  Telemetry::stop();
+  PerfRegistry::report();
+
   return 0;
 }
@@ -0,0 +1,225 @@
+#pragma once
+#include "../computing/worker.h"
+#include "../tree/tree.h"
+#include "../utils/config.h"
+#include "context_model.hpp"
+#include "decode_table.hpp"
+#include "serializer.hpp"
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <istream>
+#include <memory>
+#include <vector>
+
+/*
+One compressed record of a batch : an order 0 Huffman bitstream, as written by
+encode() with the batch table, and the buffer it is decoded into. The caller
+knows the decoded size of every record and owns both buffers, the input needs
+no slack past `in_size`.
+*/
+struct batch_span {
+  const uint8_t *in;
+  size_t in_size;
+  uint8_t *out;
+  size_t out_size;
+  // Set by decode : false when the codes are invalid or run past `in_size`
+  bool ok = false;
+};
+
+/*
+Decodes batches of small records sharing one prebuilt table, with none of the
+per message setup of an Inflator.
+
+A single record is one serial chain : every lookup needs the length of the
+previous code. The batch keeps LANES records in flight and decodes one symbol
+of each in turn, so the lookups of different records overlap in the
+pipeline. Lanes run without bound checks for as many symbols as every one of
+them can safely take, a record close to the end of its input is finished on
+its own with bounded reads and its lane takes the next record.
+
+Batches of more than PARALLEL_MIN_BYTES of output are split across workers,
+in contiguous slices of about the same output size.
+*/
+class BatchDecoder {
+public:
+  static constexpr int LANES = 4;
+  static constexpr size_t PARALLEL_MIN_BYTES = 1 << 20;
+
+private:
+  DecodeTable table;
+  // Longest code, the most bits a symbol can take
+  unsigned max_code_len = 0;
+  int worker_n = std::max(1u, std::thread::hardware_concurrency());
+
+  struct lane {
+    batch_span *span;
+    size_t pos;
+    size_t i;
+    // Bits before the last 8 bytes of the input, reads under it are in bounds
+    size_t fast_bits;
+    bool invalid;
+    bool done;
+  };
+
+  // Like peek_bits, reading nothing past `in_size`
+  static uint64_t _peek_tail(const uint8_t *in, size_t in_size, size_t pos) {
+    uint64_t window = 0;
+    size_t byte = pos >> 3;
+    if (byte < in_size)
+      std::memcpy(&window, in + byte, std::min<size_t>(8, in_size - byte));
+    return window >> (pos & 7);
+  }
+
+  // Symbols the lane decodes without any read past its input
+  size_t _safe_steps(const lane &l) const {
+    if (l.done || l.pos >= l.fast_bits)
+      return 0;
+    return std::min(l.span->out_size - l.i,
+                    (l.fast_bits - l.pos) / max_code_len);
+  }
+
+  void _start(lane &l, batch_span *span) const {
+    l.span = span;
+    l.pos = 0;
+    l.i = 0;
+    l.fast_bits = span->in_size >= 8 ? (span->in_size - 7) * 8 : 0;
+    l.invalid = false;
+    l.done = false;
+  }
+
+  // Decode the rest of the lane record with bounded reads
+  void _finish(lane &l) const {
+    auto span = l.span;
+    for (; !l.invalid && l.i < span->out_size; l.i++) {
+      auto entry = table.lookup(_peek_tail(span->in, span->in_size, l.pos));
+      l.invalid = !entry.len;
+      span->out[l.i] = entry.value;
+      l.pos += entry.len;
+    }
+    span->ok = !l.invalid && l.pos <= span->in_size * 8;
+    l.done = true;
+  }
+
+  void _decode_range(batch_span *spans, size_t n) const {
+    size_t next = 0;
+    std::array<lane, LANES> lanes;
+    if (n >= LANES) {
+      for (auto &l : lanes)
+        _start(l, &spans[next++]);
+
+      while (true) {
+        size_t steps = SIZE_MAX;
+        for (auto &l : lanes)
+          steps = std::min(steps, _safe_steps(l));
+
+        if (!steps) {
+          // Retire the lanes that cannot go on unchecked
+          for (auto &l : lanes) {
+            if (_safe_steps(l))
+              continue;
+            _finish(l);
+            if (next < n)
+              _start(l, &spans[next++]);
+          }
+          if (next == n)
+            break;
+          continue;
+        }
+
+        for (size_t s = 0; s < steps; s++) {
+#pragma GCC unroll 4
+          for (int k = 0; k < LANES; k++) {
+            auto &l = lanes[k];
+            auto entry = table.lookup(peek_bits(l.span->in, l.pos));
+            l.invalid |= !entry.len;
+            l.span->out[l.i++] = entry.value;
+            l.pos += entry.len;
+          }
+        }
+      }
+
+      // Records still in a lane when the batch ran out
+      for (auto &l : lanes)
+        if (!l.done)
+          _finish(l);
+    }
+
+    for (; next < n; next++) {
+      lane l;
+      _start(l, &spans[next]);
+      _finish(l);
+    }
+  }
+
+public:
+  BatchDecoder(const code_table_t &codes) : table(codes) {
+    for (auto entry : codes)
+      max_code_len = std::max(max_code_len, code_len(entry));
+    max_code_len = std::max(max_code_len, 1u);
+  }
+
+  template <typename T>
+  BatchDecoder(const TreeNode<T> &tree)
+      : BatchDecoder(BatchDecoder::_codes(tree)) {}
+
+  /*
+  Decoder of the header table of a compressed file, `istream` at its start :
+  the records are coded with the table the file was written with. nullptr
+  for a corrupt header or an order 1 file, which has no single table.
+  */
+  static std::unique_ptr<BatchDecoder>
+  from_header(std::shared_ptr<std::basic_istream<char>> istream) {
+    if (read_magic(*istream) != FORMAT_CURRENT)
+      return nullptr;
+    read_u64(*istream);
+    char type = 0;
+    if (!istream->read(&type, 1) || type != MODEL_ORDER0)
+      return nullptr;
+    auto tree = deserialize_preorder(istream, MAX_CODE_LEN);
+    if (!tree)
+      return nullptr;
+    return std::make_unique<BatchDecoder>(*tree);
+  }
+
+  template <typename T> static code_table_t _codes(const TreeNode<T> &tree) {
+    code_table_t codes = {0};
+    collect_codes(tree, codes);
+    return codes;
+  }
+
+  void set_worker_n(int n) { worker_n = std::max(n, 1); }
+
+  // Decode every span into its `out`, returns the number of records decoded
+  // without error
+  size_t decode(batch_span *spans, size_t n) const {
+    size_t total = 0;
+    for (size_t i = 0; i < n; i++)
+      total += spans[i].out_size;
+
+#ifdef PARALLELIZATION
+    if (worker_n > 1 && total >= PARALLEL_MIN_BYTES && n > 1) {
+      LoadDispatcher<char> dispatcher(0, 0, worker_n);
+      size_t slice_bytes = total / worker_n + 1;
+      size_t first = 0, bytes = 0;
+      for (size_t i = 0; i < n; i++) {
+        bytes += spans[i].out_size;
+        if (bytes < slice_bytes && i + 1 < n)
+          continue;
+        auto worker = dispatcher.request_worker();
+        worker->run([this](batch_span *spans,
+                           size_t n) { _decode_range(spans, n); },
+                    spans + first, i + 1 - first);
+        first = i + 1;
+        bytes = 0;
+      }
+      dispatcher.join();
+    } else
+#endif
+      _decode_range(spans, n);
+
+    return std::count_if(spans, spans + n,
+                         [](const batch_span &span) { return span.ok; });
+  }
+};
@@ -1,25 +1,38 @@
+#include "../computing/buffer_pool.h"
+#include "../computing/numa.h"
+#include "../computing/tuner.h"
 #include "../computing/worker.h"
 #include "../tree/tree.h"
+#include "../utils/config.h"
+#include "../utils/perf_counters.hpp"
 #include "../utils/profiling.hpp"
+#include "../utils/telemetry.hpp"
+#include "context_model.hpp"
+#include "decode_table.hpp"
+#include "encode_kernel.hpp"
 #include "serializer.hpp"
 #include "transformer.hpp"
 #include <algorithm>
 #include <cassert>
 #include <cmath>
+#include <deque>
+#include <future>
+#include <iomanip>
 #include <iostream>
 #include <istream>
 #include <map>
 #include <memory>
 #include <numeric>
 #include <ostream>
+#include <queue>
+#include <sstream>
 #include <string>
 
-#define PARALLELIZATION
-
 template <typename T, size_t size>
-void compute_chunk(int n, std::shared_ptr<char[]> data,
-                   std::array<std::atomic<int>, size> *lock_free_array) {
-  std::array<int, size> tmp_array = {0};
+void compute_chunk(size_t n, std::shared_ptr<char[]> data,
+                   std::array<std::atomic<int64_t>, size> *lock_free_array) {
+  PerfScope perf_scope("frequency/chunk", n, current_worker_id);
+  std::array<int64_t, size> tmp_array = {0};
 
   auto begin = (std::make_unsigned_t<T> *)data.get();
 
@@ -32,9 +45,139 @@ void compute_chunk(int n, std::shared_ptr<char[]> data,
   }
 }
 
+// Histogram of a single block, kept apart for the analysis
+template <typename T, typename count_t, size_t size>
+void compute_block(size_t n, std::shared_ptr<char[]> data,
+                   std::array<count_t, size> *counts) {
+  PerfScope perf_scope("frequency/chunk", n, current_worker_id);
+  counts->fill(0);
+  auto begin = (std::make_unsigned_t<T> *)data.get();
+  std::for_each_n(begin, n, [counts](const std::make_unsigned_t<T> c) {
+    (*counts)[c] += 1;
+  });
+}
+
+/*
+Order 1 histogram of a chunk. `prev` is the byte before the chunk, -1 when it
+is unknown and the first pair is skipped.
+*/
+template <typename T>
+void compute_chunk_order1(size_t n, std::shared_ptr<char[]> data, int prev,
+                          std::vector<std::atomic<int64_t>> *pair_counts) {
+  PerfScope perf_scope("frequency/chunk", n, current_worker_id);
+  std::vector<int64_t> tmp_counts(CONTEXT_N * (UCHAR_MAX + 1), 0);
+
+  auto begin = (std::make_unsigned_t<T> *)data.get();
+  size_t i = 0;
+  if (prev < 0)
+    prev = begin[i++];
+  for (; i < n; i++) {
+    tmp_counts[prev * (UCHAR_MAX + 1) + begin[i]]++;
+    prev = begin[i];
+  }
+
+  for (size_t i = 0; i < tmp_counts.size(); i++) {
+    if (tmp_counts[i])
+      (*pair_counts)[i].fetch_add(tmp_counts[i], std::memory_order_relaxed);
+  }
+}
+
+// Shannon entropy of a histogram, in bits per symbol
+template <typename count_t, size_t size>
+double entropy(const std::array<count_t, size> &counts, size_t n) {
+  double h = 0;
+  for (auto count : counts) {
+    if (!count)
+      continue;
+    double p = (double)count / n;
+    h -= p * std::log2(p);
+  }
+  return h;
+}
+
+// Huffman code lengths of a histogram, 0 for absent symbols
+template <typename count_t, size_t size>
+std::array<unsigned, size> huffman_lengths(const std::array<count_t, size> &counts) {
+  using item = std::pair<uint64_t, int>;
+  std::priority_queue<item, std::vector<item>, std::greater<item>> heap;
+  std::vector<int> parent;
+  std::array<int, size> leaf;
+  std::array<unsigned, size> lengths = {0};
+
+  for (size_t i = 0; i < size; i++) {
+    leaf[i] = -1;
+    if (!counts[i])
+      continue;
+    leaf[i] = parent.size();
+    heap.push({(uint64_t)counts[i], leaf[i]});
+    parent.push_back(-1);
+  }
+
+  // A lone symbol still takes one bit, the heap holds its leaf, not the symbol
+  if (heap.size() == 1) {
+    lengths[std::find(leaf.begin(), leaf.end(), 0) - leaf.begin()] = 1;
+    return lengths;
+  }
+
+  while (heap.size() > 1) {
+    auto a = heap.top();
+    heap.pop();
+    auto b = heap.top();
+    heap.pop();
+    parent[a.second] = parent[b.second] = parent.size();
+    heap.push({a.first + b.first, (int)parent.size()});
+    parent.push_back(-1);
+  }
+
+  for (size_t i = 0; i < size; i++) {
+    for (int node = leaf[i]; node != -1 && parent[node] != -1;
+         node = parent[node])
+      lengths[i]++;
+  }
+  return lengths;
+}
+
+/*
+Order 0 table a block is coded with. Blocks hand the current table to the
+next one : deciding between the current table and a new one is the only step
+done in block order, the encoding itself stays parallel.
+*/
+struct block_table {
+  code_table_t codes = {0};
+  unsigned max_code_len = 0;
+  // Serialized tree, sent in the block that switches to the table
+  std::vector<char> tree;
+};
+
+// What the write pass coded, gathered by the encoding workers
+struct write_stats {
+  // Every symbol : the exact histogram of the input
+  std::array<std::atomic<int64_t>, UCHAR_MAX + 1> counts = {};
+  // Symbols of the blocks coded with the header table
+  std::array<std::atomic<int64_t>, UCHAR_MAX + 1> header_table_counts = {};
+  // Blocks written, headers included
+  std::atomic<uint64_t> size = 0;
+};
+
+// Running totals of an analysis, blocks are folded in file order
+struct analysis_totals {
+  size_t predicted_size = 0;
+  size_t block_n = 0;
+  size_t stored_n = 0, constant_n = 0, table_n = 0;
+  size_t local_saving = 0;
+  double entropy_sum = 0, entropy_square_sum = 0;
+  // Table the next block starts from, as __next_table hands it over
+  std::shared_ptr<const block_table> current;
+};
+using table_future = std::shared_future<std::shared_ptr<const block_table>>;
+using table_promise = std::promise<std::shared_ptr<const block_table>>;
+
 template <typename buffer_t> struct out_segment_info {
   std::shared_ptr<buffer_t[]> data;
-  int size;
+  // Pool `data` goes back to once written
+  BufferPool<buffer_t> *pool;
+  block_header header;
+  size_t size;
   bool last;
   bool available;
 };
@@ -43,188 +186,863 @@ template <typename T> class Compressor : public Transformer<T> {
   using Transformer<T>::istream;
   using Transformer<T>::ostream;
 
-  std::unordered_map<T, int> frequency;
-  std::map<T, std::pair<uint32_t, int>> dictionnary;
-  std::array<T, UCHAR_MAX + 1> size_dict;
-  std::array<T, UCHAR_MAX + 1> word_dict;
+  std::unordered_map<T, int64_t> frequency;
+  std::map<T, std::pair<uint64_t, int>> dictionnary;
+  context_model model;
+  pair_counts_t pair_counts;
+  std::vector<std::unique_ptr<TreeNode<T>>> group_trees;
+  // Histogram of every block of the analysis, blocks fit in 32 bits counts
+  std::vector<std::array<uint32_t, UCHAR_MAX + 1>> block_counts;
+
+  // Fraction of the input the histogram is built from, 1 reads everything
+  double sample_fraction = 1;
+  // Blocks may switch to their own order 0 table when it pays for itself
+  bool adaptive_tables = true;
+  // Exact histogram of what was actually encoded
+  std::array<int64_t, UCHAR_MAX + 1> written_counts = {0};
+  // The part of it coded with the header table, and the size of the blocks
+  std::array<int64_t, UCHAR_MAX + 1> header_table_counts = {0};
+  uint64_t written_size = 0;
   std::vector<std::vector<char>> segments;
   std::unique_ptr<TreeNode<T>> tree_root;
+  // Size of the input, recorded in the file header
+  uint64_t input_size = 0;
+
+  // 0 means no limit : pools are sized with their defaults
+  size_t memory_limit = 0;
+  // Fewest workers a parallel stage runs with, whatever the memory limit
+  static constexpr int MIN_WORKER_N = 2;
+
+  TuningProfile profile;
+  // Empty unless workers are pinned to the NUMA nodes
+  NumaPlacement placement;
 
 public:
   void __compute_frequency_single_threaded();
+  static std::unique_ptr<TreeNode<T>>
+  __build_tree(std::unordered_map<T, int64_t> frequency);
+  static std::unique_ptr<TreeNode<T>>
+  __build_huffman(std::unordered_map<T, int64_t> frequency);
   void __compute_tree();
   void __compute_dict();
+  void __compute_context_model();
   void __compute_segments();
   void __write_early_segments();
   void __traversal();
   void __write_single_thread();
-  void __flush_buffer(size_t length, uint64_t buffer);
   Compressor(std::shared_ptr<std::basic_istream<T>> s) : Transformer<T>(s){};
 
+  void set_memory_limit(size_t limit) { memory_limit = limit; }
+  void set_sample_fraction(double fraction) { sample_fraction = fraction; }
+  void set_adaptive_tables(bool adaptive) { adaptive_tables = adaptive; }
+  void set_order1(bool order1) {
+    model.type = order1 ? MODEL_ORDER1 : MODEL_ORDER0;
+  }
+  void set_profile(const TuningProfile &p) { profile = p; }
+  void set_numa(bool numa) {
+    placement = numa ? NumaPlacement(read_topology()) : NumaPlacement();
+  }
+  TuningProfile get_profile() const { return profile; }
+  // Cached profile of this machine if there is one, never calibrates
+  void load_profile() {
+#ifdef PARALLELIZATION
+    Autotuner(read_topology()).load(profile);
+#endif
+  }
+  void autotune(bool retune);
+  void analyze();
+
   // Parallzlization utils
   void __write_parallelized();
   void __compute_frequency_parallelized();
-  std::pair<int, int> __seek_cut(std::shared_ptr<T[]> buffer, int chunk_s);
+  void __compute_frequency_sampled();
+  void __dispatch_histogram(std::shared_ptr<Worker<char>> worker, size_t n,
+                            int prev,
+                            std::array<std::atomic<int64_t>, UCHAR_MAX + 1> *counts,
+                            std::vector<std::atomic<int64_t>> *pair_counts);
+  void
+  __collect_histogram(std::array<std::atomic<int64_t>, UCHAR_MAX + 1> &counts,
+                      std::vector<std::atomic<int64_t>> &pair_counts,
+                      int64_t min_frequency);
+  void __report_sampling();
+  void __compute_block_histograms();
+  void __analyze_blocks(analysis_totals &totals);
+  void __analyze_block(const std::array<int64_t, UCHAR_MAX + 1> &counts,
+                       size_t n, analysis_totals &totals);
+  void __report_analysis(const analysis_totals &totals);
+  void __plan_memory(size_t in_buffer_s, size_t out_buffer_s, int max_worker_n,
+                     int &worker_n, size_t &out_buffer_n);
+  size_t __max_chunk_size() const;
+  void __fit_chunk_sizes();
+
+  static block_header
+  __choose_block(const std::array<int64_t, UCHAR_MAX + 1> &counts, size_t n,
+                 const T *in, T prev, const context_model &model,
+                 const block_table *table = nullptr, bool send_table = false);
+  static std::shared_ptr<const block_table>
+  __choose_table(const std::array<int64_t, UCHAR_MAX + 1> &counts,
+                 const std::shared_ptr<const block_table> &current);
+  static std::shared_ptr<const block_table>
+  __next_table(const std::array<int64_t, UCHAR_MAX + 1> &counts, size_t n,
+               const std::shared_ptr<const block_table> &current,
+               const context_model &model, block_header &header);
+  std::shared_ptr<const block_table> __file_table();
 
   template <typename buffer_t>
   static void
-  __translate(int in_buffer_s, std::shared_ptr<T[]> in_buffer,
-              std::shared_ptr<buffer_t[]> out_buffer,
-              std::array<T, UCHAR_MAX + 1> size_dict,
-              std::array<T, UCHAR_MAX + 1> word_dict,
-              std::mutex *out_segments_m,
-              std::condition_variable *out_segments_cv,
-              std::shared_ptr<out_segment_info<buffer_t>> out_segment);
+  __encode_block(size_t in_buffer_s, std::shared_ptr<T[]> in_buffer,
+                 std::shared_ptr<buffer_t[]> out_buffer,
+                 const context_model *model, T prev,
+                 table_future current_table,
+                 std::shared_ptr<table_promise> next_table,
+                 write_stats *stats,
+                 std::mutex *out_segments_m,
+                 std::condition_variable *out_segments_cv,
+                 std::shared_ptr<out_segment_info<buffer_t>> out_segment);
 
   template <typename buffer_t>
   static void __write_out(
       std::shared_ptr<std::basic_ostream<T>> ostream,
-      std::vector<std::shared_ptr<out_segment_info<buffer_t>>> *out_segments,
+      std::deque<std::shared_ptr<out_segment_info<buffer_t>>> *out_segments,
       std::mutex *out_segments_m, std::condition_variable *out_segments_cv);
   void run() override;
 };
 
 template <typename T> void Compressor<T>::run() {
+  istream->seekg(0, std::ios::end);
+  input_size = istream->tellg();
+  istream->seekg(0);
+  __fit_chunk_sizes();
+
+  Telemetry::begin_phase("frequency", input_size * std::min(sample_fraction, 1.));
   #ifdef PARALLELIZATION
-  PROFILE(__compute_frequency_parallelized())
+  if (sample_fraction < 1) {
+    PERF_STAGE("frequency", input_size * sample_fraction,
+               PROFILE(__compute_frequency_sampled()))
+  } else {
+    PERF_STAGE("frequency", input_size,
+               PROFILE(__compute_frequency_parallelized()))
+  }
   #else
-  PROFILE(__compute_frequency_single_threaded())
+  PERF_STAGE("frequency", input_size,
+             PROFILE(__compute_frequency_single_threaded()))
   #endif
 
-  PROFILE(__compute_tree())
-  PROFILE(__compute_segments())
-  PROFILE(__write_early_segments())
-  PROFILE(__compute_dict())
+  if (model.type == MODEL_ORDER1) {
+    PERF_STAGE("tree", 0, PROFILE(__compute_context_model()))
+    PROFILE(__compute_segments())
+    PROFILE(__write_early_segments())
+  } else {
+    PERF_STAGE("tree", 0, PROFILE(__compute_tree()))
+    PROFILE(__compute_segments())
+    PROFILE(__write_early_segments())
+    PERF_STAGE("dict", 0, PROFILE(__compute_dict()))
+  }
 
+  Telemetry::begin_phase("encode", input_size);
   #ifdef PARALLELIZATION
-  PROFILE(__write_parallelized())
+  PERF_STAGE("write", input_size, PROFILE(__write_parallelized()))
+  if (sample_fraction < 1)
+    __report_sampling();
   #else
-  PROFILE(__write_single_thread())
+  PERF_STAGE("write", input_size, PROFILE(__write_single_thread()))
   #endif
 }
 
+/*
+Dry run : nothing is encoded or written. The input is read once, keeping the
+histogram of every block __write_parallelized would cut, the tree is built as
+run() does, then the block decisions are replayed from the histograms, so the
+predicted size is the size of the file run() writes.
+*/
+template <typename T> void Compressor<T>::analyze() {
+  istream->seekg(0, std::ios::end);
+  input_size = istream->tellg();
+  istream->seekg(0);
+  __fit_chunk_sizes();
+
+  if (model.type != MODEL_ORDER0) {
+    INFO("Analysis : order 1 is not modeled, reporting order 0");
+  }
+  model.type = MODEL_ORDER0;
+
+  Telemetry::begin_phase("frequency", input_size);
+  PERF_STAGE("frequency", input_size, PROFILE(__compute_block_histograms()))
+  PERF_STAGE("tree", 0, PROFILE(__compute_tree()))
+  PROFILE(__compute_segments())
+  PERF_STAGE("dict", 0, PROFILE(__compute_dict()))
+
+  analysis_totals totals;
+  for (auto &segment : segments)
+    totals.predicted_size += segment.size();
+  totals.current = __file_table();
+  Telemetry::begin_phase("analyze", 0);
+  PERF_STAGE("analyze", 0, PROFILE(__analyze_blocks(totals)))
+  __report_analysis(totals);
+}
+
+/*
+Load the tuning profile of this machine, or calibrate one on the head of the
+input. Calibration runs the real stages on an in-memory copy of the sample so
+it measures exactly what a full run would do.
+
+The single threaded build has no workers to size : it keeps the default
+profile.
+*/
+template <typename T> void Compressor<T>::autotune(bool retune) {
+#ifdef PARALLELIZATION
+  constexpr size_t SAMPLE_SIZE = 32 * 1024 * 1024;
+
+  auto topology = read_topology();
+  Autotuner tuner(topology);
+
+  if (!retune && tuner.load(profile))
+    return;
+
+  // Calibration reads and writes count as their own phase
+  Telemetry::begin_phase("autotune", 0);
+  std::basic_string<T> sample(SAMPLE_SIZE, 0);
+  istream->read(sample.data(), SAMPLE_SIZE);
+  sample.resize(istream->gcount());
+  istream->clear();
+  istream->seekg(0);
+
+  // Too small to be representative : scale the defaults to the machine
+  if (sample.size() < SAMPLE_SIZE) {
+    profile.frequency.worker_n = std::max(2, topology.core_n);
+    profile.write.worker_n = std::max(2, topology.core_n);
+    return;
+  }
+
+  auto sampler = Compressor<T>(
+      std::make_shared<std::basic_istringstream<T>>(std::move(sample)));
+  sampler.set_output(std::make_shared<std::basic_ostream<T>>(nullptr));
+  sampler.set_memory_limit(memory_limit);
+
+  auto rewind = [&sampler]() {
+    sampler.istream->clear();
+    sampler.istream->seekg(0);
+  };
+
+  profile.frequency = tuner.calibrate_stage(
+      "frequency",
+      [&sampler, &rewind](const StageProfile &p) {
+        rewind();
+        sampler.profile.frequency = p;
+        sampler.frequency.clear();
+        sampler.__compute_frequency_parallelized();
+      },
+      SAMPLE_SIZE, __max_chunk_size());
+
+  // The write stage needs a dictionnary
+  rewind();
+  sampler.profile.frequency = profile.frequency;
+  sampler.__compute_frequency_parallelized();
+  sampler.__compute_tree();
+  sampler.__compute_dict();
+
+  // The block size stays the default one, so is the output
+  StageProfile write = {StageProfile().chunk_size, std::max(2, topology.core_n)};
+  write.chunk_size = std::min(write.chunk_size, __max_chunk_size());
+  profile.write = tuner.calibrate_workers(
+      "write",
+      [&sampler, &rewind](const StageProfile &p) {
+        rewind();
+        sampler.profile.write = p;
+        sampler.__write_parallelized();
+      },
+      write);
+
+  tuner.save(profile);
+#else
+  (void)retune;
+#endif
+}
+
+/*
+Largest chunk the memory limit holds : the smallest plan is MIN_WORKER_N input
+buffers and one output buffer of a chunk and 2 words of slack, see
+__write_parallelized. Never below the smallest chunk the tuner tries.
+*/
+template <typename T> size_t Compressor<T>::__max_chunk_size() const {
+  constexpr size_t OUT_SLACK = 2 * sizeof(uint64_t);
+  if (!memory_limit)
+    return SIZE_MAX;
+  if (memory_limit <= OUT_SLACK)
+    return Autotuner::MIN_CHUNK_SIZE;
+  return std::max(Autotuner::MIN_CHUNK_SIZE,
+                  (memory_limit - OUT_SLACK) / (MIN_WORKER_N + 1));
+}
+
+/*
+Shrink the chunks of a profile the memory limit cannot hold, and the write
+chunks, which are the blocks of the file, to MAX_BLOCK_SIZE
+*/
+template <typename T> void Compressor<T>::__fit_chunk_sizes() {
+  profile.write.chunk_size =
+      std::min<size_t>(profile.write.chunk_size, MAX_BLOCK_SIZE);
+
+  size_t max_chunk = __max_chunk_size();
+  bool shrunk = false;
+  for (auto stage : {&profile.frequency, &profile.write}) {
+    shrunk = shrunk || stage->chunk_size > max_chunk;
+    stage->chunk_size = std::min(stage->chunk_size, max_chunk);
+  }
+  if (shrunk) {
+    INFO("Memory limit " << memory_limit << " : chunks shrunk to " << max_chunk
+                         << " bytes");
+  }
+}
+
 #ifdef PARALLELIZATION
 
+/*
+Split the memory budget between the workers input buffers and the pool of
+output buffers. Every worker owns one input buffer for its whole life, every
+chunk in flight owns one output buffer until the writer has flushed it.
+*/
+template <typename T>
+void Compressor<T>::__plan_memory(size_t in_buffer_s, size_t out_buffer_s,
+                                  int max_worker_n, int &worker_n,
+                                  size_t &out_buffer_n) {
+  worker_n = std::max(max_worker_n, MIN_WORKER_N);
+  out_buffer_n = 2 * worker_n;
+
+  if (!memory_limit)
+    return;
+
+  size_t slots = memory_limit / (in_buffer_s + out_buffer_s);
+  worker_n = std::clamp<int>(slots, MIN_WORKER_N, worker_n);
+
+  size_t in_memory = worker_n * in_buffer_s;
+  size_t left = memory_limit > in_memory ? memory_limit - in_memory : 0;
+  out_buffer_n = std::clamp<size_t>(left / std::max<size_t>(out_buffer_s, 1),
+                                    1, out_buffer_n);
+
+  if (memory_limit < MIN_WORKER_N * in_buffer_s + out_buffer_s) {
+    INFO("Memory limit " << memory_limit << " is below the minimum of "
+                         << MIN_WORKER_N * in_buffer_s + out_buffer_s
+                         << " bytes : using the minimum");
+  }
+  DEBUG("Memory plan : " << worker_n << " workers, " << out_buffer_n
+                         << " output buffers");
+}
+
 template <typename T> void Compressor<T>::__compute_frequency_parallelized() {
-    int CHUNK_SIZE = 1000000;
+  size_t CHUNK_SIZE = profile.frequency.chunk_size;
 
-  LoadDispatcher<char> dispatcher(0, CHUNK_SIZE);
+  int worker_n;
+  size_t out_buffer_n;
+  __plan_memory(CHUNK_SIZE, 0, profile.frequency.worker_n, worker_n,
+                out_buffer_n);
 
-  assert(std::atomic_int::is_always_lock_free);
+  LoadDispatcher<char> dispatcher(0, CHUNK_SIZE, worker_n, &placement);
 
-  std::array<std::atomic<int>, UCHAR_MAX + 1> free_array = {0};
+  assert(std::atomic<int64_t>::is_always_lock_free);
 
+  std::array<std::atomic<int64_t>, UCHAR_MAX + 1> free_array = {0};
+  std::vector<std::atomic<int64_t>> pair_array(
+      model.type == MODEL_ORDER1 ? CONTEXT_N * (UCHAR_MAX + 1) : 0);
+
+  // The encoder starts every file with a 0 context
+  int prev = 0;
   while (!istream->eof()) {
     auto worker = dispatcher.request_worker();
     auto buffer = reinterpret_cast<char *>(worker->get_buffer().get());
     istream->read(buffer, CHUNK_SIZE);
     auto n = istream->gcount();
-    auto data = worker->get_buffer();
-    worker->run(compute_chunk<char, UCHAR_MAX + 1>, n, data, &free_array);
+    Telemetry::add_read(n);
+    __dispatch_histogram(worker, n, prev, &free_array, &pair_array);
+    if (n)
+      prev = (std::make_unsigned_t<T>)buffer[n - 1];
   };
 
   dispatcher.join();
 
-  for (auto i = 0; i < free_array.size(); i++) {
-    if (free_array[i].load())
-      this->frequency[i] = free_array[i].load();
-  }
+  __collect_histogram(free_array, pair_array, 0);
 
   istream->clear();
 }
 
+template <typename T>
+void Compressor<T>::__dispatch_histogram(
+    std::shared_ptr<Worker<char>> worker, size_t n, int prev,
+    std::array<std::atomic<int64_t>, UCHAR_MAX + 1> *counts,
+    std::vector<std::atomic<int64_t>> *pair_counts) {
+  auto data = worker->get_buffer();
+  if (model.type == MODEL_ORDER1)
+    worker->run(compute_chunk_order1<char>, n, data, prev, pair_counts);
+  else
+    worker->run(compute_chunk<char, UCHAR_MAX + 1>, n, data, counts);
+}
 
 /*
-This function reads the input stream and find the highest number of char that
-can be read while ensuring the translation would generate an out_buff such that
-`out_buff.size() % 8 == 0` This will help when merging buffer to the output
-stream.
+Move the histograms of the workers into `frequency`, and `pair_counts` for an
+order 1 model. Symbols under `min_frequency` are raised to it.
 */
 template <typename T>
-std::pair<int, int> Compressor<T>::__seek_cut(std::shared_ptr<T[]> buffer,
-                                              int chunk_s) {
-  int virtual_out_size = 0;
-  int best_fitting = 0;
+void Compressor<T>::__collect_histogram(
+    std::array<std::atomic<int64_t>, UCHAR_MAX + 1> &counts,
+    std::vector<std::atomic<int64_t>> &pair_array, int64_t min_frequency) {
+  if (model.type == MODEL_ORDER1) {
+    pair_counts.assign(CONTEXT_N, {0});
+    for (size_t c = 0; c < CONTEXT_N; c++) {
+      for (int s = 0; s <= UCHAR_MAX; s++) {
+        pair_counts[c][s] = pair_array[c * (UCHAR_MAX + 1) + s].load();
+        counts[s] += pair_counts[c][s];
+      }
+    }
+  }
+
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i].load() || min_frequency)
+      this->frequency[i] = std::max(counts[i].load(), min_frequency);
+  }
+}
+
+
+/*
+Build the histogram from `sample_fraction` of the chunks, evenly spaced over
+the input. Symbols that were not sampled get a frequency of 1 so they still
+have a code if they show up during the write pass.
+*/
+template <typename T> void Compressor<T>::__compute_frequency_sampled() {
+  size_t CHUNK_SIZE = profile.frequency.chunk_size;
+
+  int worker_n;
+  size_t out_buffer_n;
+  __plan_memory(CHUNK_SIZE, 0, profile.frequency.worker_n, worker_n,
+                out_buffer_n);
+
+  LoadDispatcher<char> dispatcher(0, CHUNK_SIZE, worker_n, &placement);
+
+  std::array<std::atomic<int64_t>, UCHAR_MAX + 1> free_array = {0};
+  std::vector<std::atomic<int64_t>> pair_array(
+      model.type == MODEL_ORDER1 ? CONTEXT_N * (UCHAR_MAX + 1) : 0);
+
+  istream->seekg(0, std::ios::end);
+  size_t input_size = istream->tellg();
+  size_t chunk_n = input_size / CHUNK_SIZE + (input_size % CHUNK_SIZE != 0);
+  size_t sample_n = std::clamp<size_t>(std::ceil(chunk_n * sample_fraction), 1,
+                                       std::max<size_t>(chunk_n, 1));
+
+  for (size_t i = 0; i < sample_n; i++) {
+    auto worker = dispatcher.request_worker();
+    auto buffer = reinterpret_cast<char *>(worker->get_buffer().get());
+    istream->seekg((i * chunk_n / sample_n) * CHUNK_SIZE);
+    istream->read(buffer, CHUNK_SIZE);
+    auto n = istream->gcount();
+    istream->clear();
+    Telemetry::add_read(n);
+    __dispatch_histogram(worker, n, -1, &free_array, &pair_array);
+  }
+
+  dispatcher.join();
+
+  __collect_histogram(free_array, pair_array, 1);
+
+  INFO("Sampled " << sample_n << "/" << chunk_n << " chunks");
+  istream->clear();
+}
 
-  auto begin = buffer.get();
+#endif
 
-  istream->read(begin, chunk_s);
+/*
+Histogram pass of the analysis, the only read of the input : it is read in the
+blocks of profile.write.chunk_size bytes __write_parallelized would cut, every
+block histogram is kept in 32 bits counts, 1 KB per block, and their sum is
+the histogram of the file.
+*/
+template <typename T> void Compressor<T>::__compute_block_histograms() {
+  size_t CHUNK_SIZE = profile.write.chunk_size;
+  // An empty input is still written as one empty block
+  size_t block_n = std::max<size_t>(1, (input_size + CHUNK_SIZE - 1) / CHUNK_SIZE);
+  block_counts.assign(block_n, {0});
+  istream->seekg(0);
 
-  auto count = istream->gcount();
+#ifdef PARALLELIZATION
+  int worker_n;
+  size_t out_buffer_n;
+  __plan_memory(CHUNK_SIZE, 0, profile.frequency.worker_n, worker_n,
+                out_buffer_n);
 
-  int best_virtual_out_size = 0;
+  LoadDispatcher<char> dispatcher(0, CHUNK_SIZE, worker_n, &placement);
+  for (size_t i = 0; i < block_n; i++) {
+    auto worker = dispatcher.request_worker();
+    istream->read(worker->get_buffer().get(), CHUNK_SIZE);
+    size_t n = istream->gcount();
+    Telemetry::add_read(n);
+    worker->run(compute_block<char, uint32_t, UCHAR_MAX + 1>, n,
+                worker->get_buffer(), &block_counts[i]);
+  }
+  dispatcher.join();
+#else
+  auto buffer = std::make_shared<char[]>(CHUNK_SIZE);
+  for (size_t i = 0; i < block_n; i++) {
+    istream->read(buffer.get(), CHUNK_SIZE);
+    size_t n = istream->gcount();
+    Telemetry::add_read(n);
+    compute_block<char, uint32_t, UCHAR_MAX + 1>(n, buffer, &block_counts[i]);
+  }
+#endif
+  istream->clear();
+
+  std::array<int64_t, UCHAR_MAX + 1> counts = {0};
+  for (auto &block : block_counts)
+    for (size_t s = 0; s <= UCHAR_MAX; s++)
+      counts[s] += block[s];
+  for (size_t s = 0; s <= UCHAR_MAX; s++)
+    if (counts[s])
+      frequency[s] = counts[s];
+}
 
-  for (int i = 0; i < count; ++i) {
-    virtual_out_size += size_dict[*(begin + i)];
-    best_fitting = (virtual_out_size % 64 == 0) ? i : best_fitting;
-    best_virtual_out_size =
-        (virtual_out_size % 64 == 0) ? virtual_out_size : best_virtual_out_size;
+// Replay the block decisions of the writer on the block histograms
+template <typename T>
+void Compressor<T>::__analyze_blocks(analysis_totals &totals) {
+#ifndef PARALLELIZATION
+  // The single threaded writer never switches tables
+  adaptive_tables = false;
+#endif
+  std::array<int64_t, UCHAR_MAX + 1> counts;
+  for (auto &block : block_counts) {
+    size_t n = 0;
+    for (size_t s = 0; s <= UCHAR_MAX; s++)
+      n += counts[s] = block[s];
+    __analyze_block(counts, n, totals);
+  }
+}
+
+// Add a block to the totals, in file order
+template <typename T>
+void Compressor<T>::__analyze_block(
+    const std::array<int64_t, UCHAR_MAX + 1> &block, size_t n,
+    analysis_totals &totals) {
+  block_header header;
+  if (adaptive_tables)
+    totals.current = __next_table(block, n, totals.current, model, header);
+  else
+    header = __choose_block(block, n, nullptr, 0, model);
+  totals.predicted_size += BLOCK_HEADER_SIZE + header.payload_size;
+  totals.block_n++;
+  totals.stored_n += header.type == BLOCK_STORED;
+  totals.constant_n += header.type == BLOCK_CONSTANT;
+  totals.table_n += header.type == BLOCK_HUFFMAN_TABLE;
+
+  double h = n ? entropy(block, n) : 0;
+  totals.entropy_sum += h;
+  totals.entropy_square_sum += h * h;
+
+  if (header.type == BLOCK_CONSTANT)
+    return;
+  auto lengths = huffman_lengths(block);
+  size_t local_bits = 0, leaf_n = 0;
+  for (size_t s = 0; s <= UCHAR_MAX; s++) {
+    local_bits += (size_t)block[s] * lengths[s];
+    leaf_n += block[s] != 0;
   }
+  size_t local_size = (local_bits + 7) / 8 + preorder_size(leaf_n);
+  // Against the block as predicted, table switches already count there
+  if (local_size < header.payload_size)
+    totals.local_saving += header.payload_size - local_size;
+}
 
-  // Last segment of the file
-  if (istream->eof())
-    return {count, virtual_out_size};
+/*
+ - entropy : Shannon bound of an order 0 code over the whole file
+ - huffman : sum of frequency x code length, plus the header
+ - predicted : the file run() writes, every block stored, constant or huffman
+   as __choose_block decides, switching tables as __next_table does
+ - block entropy : spread of the entropy across blocks, a large one means the
+   data changes along the file
+ - per block tables : bytes saved over the predicted file if every block had
+   its own tree, paying for that tree in the block
+*/
+template <typename T>
+void Compressor<T>::__report_analysis(const analysis_totals &totals) {
+  auto &code_table = model.tables[0];
+
+  size_t header_size = 0;
+  for (auto &segment : segments)
+    header_size += segment.size();
+
+  std::array<int64_t, UCHAR_MAX + 1> counts = {0};
+  for (auto &entry : frequency)
+    counts[(std::make_unsigned_t<T>)entry.first] = entry.second;
+
+  size_t huffman_bits = 0;
+  for (size_t s = 0; s <= UCHAR_MAX; s++)
+    huffman_bits += counts[s] * code_len(code_table[s]);
+  size_t huffman_size = header_size + (huffman_bits + 7) / 8;
+  double file_entropy = input_size ? entropy(counts, input_size) : 0;
+
+  size_t predicted_size = totals.predicted_size;
+  size_t block_n = totals.block_n;
+  double entropy_mean = totals.entropy_sum / block_n;
+  double entropy_variance = std::max(
+      0., totals.entropy_square_sum / block_n - entropy_mean * entropy_mean);
+  auto ratio = [this](size_t size) {
+    return input_size ? (double)size / input_size : 0;
+  };
 
-  return {best_fitting + 1, best_virtual_out_size};
+  std::cout << std::fixed << std::setprecision(4);
+  std::cout << GREEN << "[ANALYZE] " << RESET << "input            "
+            << input_size << " B in " << block_n << " blocks of "
+            << profile.write.chunk_size << " B" << std::endl;
+  std::cout << GREEN << "[ANALYZE] " << RESET << "entropy          "
+            << file_entropy << " bits/B, bound "
+            << (size_t)(file_entropy * input_size / 8) << " B (ratio "
+            << file_entropy / 8 << ")" << std::endl;
+  std::cout << GREEN << "[ANALYZE] " << RESET << "huffman          "
+            << huffman_size << " B (ratio " << ratio(huffman_size)
+            << "), header " << header_size << " B" << std::endl;
+  std::cout << GREEN << "[ANALYZE] " << RESET << "predicted        "
+            << predicted_size << " B (ratio " << ratio(predicted_size) << ")"
+            << std::endl;
+  std::cout << GREEN << "[ANALYZE] " << RESET << "block entropy    mean "
+            << entropy_mean << " variance " << entropy_variance
+            << " bits/B" << std::endl;
+  std::cout << GREEN << "[ANALYZE] " << RESET << "per block tables "
+            << totals.local_saving << " B saved (ratio "
+            << ratio(predicted_size - totals.local_saving) << ")" << std::endl;
+  std::cout << GREEN << "[ANALYZE] " << RESET << "stored blocks    "
+            << totals.stored_n << " (" << 100. * totals.stored_n / block_n
+            << "%), constant " << totals.constant_n << ", new tables "
+            << totals.table_n << std::endl;
+  std::cout << std::defaultfloat;
 }
 
+/*
+Pick the cheapest representation of a block from its histogram :
+ - a single distinct byte is stored as a constant fill
+ - huffman is only kept when it saves at least 1 / 2^MIN_GAIN_SHIFT of the
+   block, otherwise the decoder would pay for a bit stream that is barely
+   smaller than a plain copy
+The entropy is a lower bound of any order 0 code, it rejects incompressible
+blocks before looking at the actual code lengths. An order 1 model can go
+below it, its cost is measured on the block itself.
+An order 0 block is coded with `table` when given, the header table otherwise,
+`send_table` adds the tree of `table` to the payload.
+*/
 template <typename T>
-template <typename buffer_t>
-void Compressor<T>::__translate(
-    int in_buffer_s, std::shared_ptr<T[]> in_buffer,
-    std::shared_ptr<buffer_t[]> out_buffer,
-    std::array<T, UCHAR_MAX + 1> size_dict,
-    std::array<T, UCHAR_MAX + 1> word_dict, std::mutex *out_segments_m,
-    std::condition_variable *out_segments_cv,
-    std::shared_ptr<out_segment_info<buffer_t>> out_segment) {
+block_header
+Compressor<T>::__choose_block(const std::array<int64_t, UCHAR_MAX + 1> &counts,
+                              size_t n, const T *in, T prev,
+                              const context_model &model,
+                              const block_table *table, bool send_table) {
+  constexpr int MIN_GAIN_SHIFT = 6;
+
+  block_header header = {BLOCK_STORED, n, n};
+  if (!n)
+    return header;
+
+  auto distinct = std::count_if(counts.begin(), counts.end(),
+                                [](int64_t count) { return count != 0; });
+  if (distinct == 1)
+    return {BLOCK_CONSTANT, n, 1};
+
+  size_t max_size = n - (n >> MIN_GAIN_SHIFT);
+
+  size_t huffman_bits = 0;
+  if (model.type == MODEL_ORDER0) {
+    if (entropy(counts, n) * n / 8 >= max_size)
+      return header;
+    auto &codes = table ? table->codes : model.tables[0];
+    for (size_t i = 0; i < counts.size(); i++)
+      huffman_bits += (size_t)counts[i] * code_len(codes[i]);
+  } else {
+    huffman_bits = model_cost((const uint8_t *)in, n, prev, model);
+  }
+  size_t huffman_size = huffman_bits / 8 + (huffman_bits % 8 != 0);
+  if (send_table)
+    huffman_size += table->tree.size();
 
-  T c;
+  if (huffman_size < max_size)
+    header = {send_table ? BLOCK_HUFFMAN_TABLE : BLOCK_HUFFMAN, n, huffman_size};
 
-  // Current offset in bits buffer
-  size_t offset = 0;
-  // Current offset in out_buffer
-  size_t out_offset = 0;
+  return header;
+}
 
-  // Buffer that will contain bits
-  buffer_t buffer = 0;
+/*
+Table the block is cheapest with : `current`, or a new one built from the
+block histogram when its bits saved pay for its tree. The new table only
+codes the symbols of the block : giving rare symbols a code costs about one
+bit per occurrence of a frequent one, a later block that needs them sends its
+own table instead.
+*/
+template <typename T>
+std::shared_ptr<const block_table> Compressor<T>::__choose_table(
+    const std::array<int64_t, UCHAR_MAX + 1> &counts,
+    const std::shared_ptr<const block_table> &current) {
+  auto lengths = huffman_lengths(counts);
+  size_t leaf_n = std::count_if(counts.begin(), counts.end(),
+                                [](int64_t count) { return count != 0; });
+  size_t current_bits = 0, new_bits = preorder_size(std::max<size_t>(leaf_n, 2)) * 8;
+  bool covered = true;
+  for (int s = 0; s <= UCHAR_MAX; s++) {
+    covered = covered && (!counts[s] || code_len(current->codes[s]));
+    current_bits += counts[s] * code_len(current->codes[s]);
+    new_bits += counts[s] * lengths[s];
+  }
+  if (covered && new_bits >= current_bits)
+    return current;
+
+  std::unordered_map<T, int64_t> frequency;
+  for (int s = 0; s <= UCHAR_MAX; s++)
+    if (counts[s])
+      frequency[s] = counts[s];
+  auto tree = __build_tree(frequency);
+
+  auto table = std::make_shared<block_table>();
+  collect_codes(*tree, table->codes);
+  for (auto entry : table->codes)
+    table->max_code_len = std::max(table->max_code_len, code_len(entry));
+  for (auto &segment : serialize_preorder(*tree))
+    table->tree.insert(table->tree.end(), segment.begin(), segment.end());
+  return table;
+}
 
-  constexpr size_t buffer_bits_n = sizeof(buffer) * 8;
+/*
+Block order step of an adaptive order 0 block : fills `header` and returns
+the table of the next block, `current` unless the block sent a new one.
+*/
+template <typename T>
+std::shared_ptr<const block_table> Compressor<T>::__next_table(
+    const std::array<int64_t, UCHAR_MAX + 1> &counts, size_t n,
+    const std::shared_ptr<const block_table> &current,
+    const context_model &model, block_header &header) {
+  auto table = __choose_table(counts, current);
+  bool send_table = table != current;
+  header = __choose_block(counts, n, nullptr, 0, model, table.get(), send_table);
+  return header.type == BLOCK_HUFFMAN_TABLE ? table : current;
+}
 
-  for (int i = 0; i < in_buffer_s; i++) {
+// The header table as the first current table
+template <typename T>
+std::shared_ptr<const block_table> Compressor<T>::__file_table() {
+  auto table = std::make_shared<block_table>();
+  table->codes = model.tables[0];
+  table->max_code_len = model.max_code_len;
+  return table;
+}
 
-    c = in_buffer.get()[i];
+#ifdef PARALLELIZATION
 
-    auto phrase = word_dict[c];
-    auto len = size_dict[c];
+/*
+Ratio lost to the sampled histogram. It only decides the codes of the blocks
+coded with the header table : stored and constant blocks and blocks sending
+their own table are the same whatever the first pass saw. Those blocks are
+priced with the sampled code lengths and with the ones of the exact histogram
+gathered while encoding, the difference, plus the symbols the sampled tree
+carries for nothing, is set against the size written. Blocks an exact table
+would code worse would have sent their own table instead, so a negative
+difference counts as no loss.
+*/
+template <typename T> void Compressor<T>::__report_sampling() {
+  if (model.type != MODEL_ORDER0) {
+    INFO("Sampled histogram : ratio loss is only reported for order 0");
+    return;
+  }
+  auto &code_table = model.tables[0];
+  auto exact_lengths = huffman_lengths(written_counts);
+  int64_t extra_bits = 0;
+  size_t exact_leaf_n = 0;
+  for (size_t i = 0; i < header_table_counts.size(); i++) {
+    extra_bits += header_table_counts[i] *
+                  ((int64_t)code_len(code_table[i]) - exact_lengths[i]);
+    exact_leaf_n += written_counts[i] != 0;
+  }
+  extra_bits = std::max<int64_t>(extra_bits, 0);
+  int64_t sampled_tree = preorder_size(std::max<size_t>(frequency.size(), 2));
+  int64_t exact_tree = preorder_size(std::max<size_t>(exact_leaf_n, 2));
+  extra_bits += 8 * (sampled_tree - exact_tree);
+
+  size_t size = written_size;
+  for (auto &segment : segments)
+    size += segment.size();
+  double exact_size = size - extra_bits / 8.;
+  if (exact_size <= 0)
+    return;
+  double loss = 100. * (size - exact_size) / exact_size;
+  INFO("Sampled histogram : " << size << " bytes written vs about "
+                              << (size_t)exact_size << " with an exact one ("
+                              << loss << "% ratio loss)");
+}
 
-    if (offset + len >= buffer_bits_n) {
-      // Fill gap with first bits
-      size_t gap_len = buffer_bits_n - offset;
-      buffer |= static_cast<decltype(buffer)>(phrase) << offset;
-      offset = buffer_bits_n;
+template <typename T>
+template <typename buffer_t>
+void Compressor<T>::__encode_block(
+    size_t in_buffer_s, std::shared_ptr<T[]> in_buffer,
+    std::shared_ptr<buffer_t[]> out_buffer,
+    const context_model *model, T prev, table_future current_table,
+    std::shared_ptr<table_promise> next_table,
+    write_stats *stats, std::mutex *out_segments_m,
+    std::condition_variable *out_segments_cv,
+    std::shared_ptr<out_segment_info<buffer_t>> out_segment) {
+  PerfScope perf_scope("write/encode", in_buffer_s, current_worker_id);
 
-      // Flush
-      out_buffer[out_offset++] = buffer;
+  auto in = in_buffer.get();
+  auto out = reinterpret_cast<T *>(out_buffer.get());
 
-      // Set the remaining bits as first bits
-      buffer = static_cast<decltype(buffer)>(phrase) >> gap_len;
-      offset = len - gap_len;
-    } else {
-      buffer |= static_cast<decltype(buffer)>(phrase) << offset;
-      offset += len;
-    }
+  std::array<int64_t, UCHAR_MAX + 1> counts = {0};
+  std::for_each_n((std::make_unsigned_t<T> *)in, in_buffer_s,
+                  [&counts](const std::make_unsigned_t<T> c) { counts[c]++; });
+  for (size_t i = 0; i < counts.size(); i++) {
+    if (counts[i])
+      stats->counts[i].fetch_add(counts[i], std::memory_order_relaxed);
+  }
+
+  block_header header;
+  std::shared_ptr<const block_table> table;
+  if (current_table.valid()) {
+    // Waits for the previous block to settle its table
+    auto current = current_table.get();
+    table = __next_table(counts, in_buffer_s, current, *model, header);
+    next_table->set_value(table);
+    if (header.type == BLOCK_HUFFMAN)
+      table = current;
+  } else {
+    header = __choose_block(counts, in_buffer_s, in, prev, *model);
+  }
+
+  stats->size.fetch_add(BLOCK_HEADER_SIZE + header.payload_size,
+                        std::memory_order_relaxed);
+  bool header_table = header.type == BLOCK_HUFFMAN &&
+                      model->type == MODEL_ORDER0 &&
+                      (!table || table->codes == model->tables[0]);
+  for (size_t i = 0; header_table && i < counts.size(); i++) {
+    if (counts[i])
+      stats->header_table_counts[i].fetch_add(counts[i],
+                                              std::memory_order_relaxed);
+  }
+
+  switch (header.type) {
+  case BLOCK_STORED:
+    std::memcpy(out, in, in_buffer_s);
+    break;
+  case BLOCK_CONSTANT:
+    out[0] = in[0];
+    break;
+  case BLOCK_HUFFMAN_TABLE:
+    std::memcpy(out, table->tree.data(), table->tree.size());
+    out += table->tree.size();
+    [[fallthrough]];
+  case BLOCK_HUFFMAN: {
+    size_t size;
+    if (table)
+      size = encode((const uint8_t *)in, in_buffer_s, (uint8_t *)out,
+                    table->codes, table->max_code_len);
+    else
+      size = encode((const uint8_t *)in, in_buffer_s, (uint8_t)prev,
+                    (uint8_t *)out, *model);
+    assert(size + (header.type == BLOCK_HUFFMAN_TABLE ? table->tree.size() : 0) ==
+           header.payload_size);
+    break;
+  }
   }
-  // Handle last segment
-  if (offset)
-    out_buffer[out_offset] = buffer;
 
   // Post segment to write_out thread
   out_segments_m->lock();
-  if (offset)
-    out_segment->size =
-        out_offset * sizeof(buffer_t) + offset / 8 + (offset % 8 != 0);
-  else
-    out_segment->size = out_offset * sizeof(buffer_t);
+  out_segment->header = header;
+  out_segment->size = header.payload_size;
   out_segment->available = true;
   out_segments_m->unlock();
   out_segments_cv->notify_one();
@@ -234,43 +1052,76 @@ template <typename T>
 template <typename buffer_t>
 void Compressor<T>::__write_out(
     std::shared_ptr<std::basic_ostream<T>> ostream,
-    std::vector<std::shared_ptr<out_segment_info<buffer_t>>> *out_segments,
+    std::deque<std::shared_ptr<out_segment_info<buffer_t>>> *out_segments,
     std::mutex *out_segments_m, std::condition_variable *out_segments_cv) {
-  int next_segment_to_write = 0;
+  PerfScope perf_scope("write/flush", 0, current_worker_id);
+  uint64_t written = 0;
   bool last = false;
 
   while (!last) {
     std::unique_lock lk(*out_segments_m);
     // Wait for the next segment to be ready
-    out_segments_cv->wait(lk, [&out_segments, next_segment_to_write]() {
-      return (out_segments->size() > next_segment_to_write &&
-              (*out_segments)[next_segment_to_write]->available);
+    out_segments_cv->wait(lk, [&out_segments]() {
+      return (!out_segments->empty() && out_segments->front()->available);
     });
     // Write all available consecutive segments
-    while (!last && out_segments->size() > next_segment_to_write &&
-           (*out_segments)[next_segment_to_write]->available) {
-      DEBUG("Writing segment : " << next_segment_to_write);
+    while (!last && !out_segments->empty() &&
+           out_segments->front()->available) {
+      auto out_segment_info = out_segments->front();
+      out_segments->pop_front();
+      Telemetry::set_queue_depth(out_segments->size());
       lk.unlock();
-      auto out_segment_info = (*out_segments)[next_segment_to_write];
       auto raw_data = (char *)out_segment_info->data.get();
+      write_block_header(*ostream, out_segment_info->header);
       ostream->write(raw_data, out_segment_info->size);
-      next_segment_to_write++;
+      written += BLOCK_HEADER_SIZE + out_segment_info->size;
+      Telemetry::add_written(BLOCK_HEADER_SIZE + out_segment_info->size);
       last = out_segment_info->last;
+      // Hand the buffer back to the reader
+      out_segment_info->pool->release(out_segment_info->data);
+      out_segment_info->data.reset();
       lk.lock();
     }
   }
+  perf_scope.set_bytes(written);
 }
 
 template <typename T> void Compressor<T>::__write_parallelized() {
 
-  constexpr int CHUNK_SIZE = 1000000;
-  constexpr int OUT_CHUNK_SIZE = sizeof(uint64_t);
+  const size_t CHUNK_SIZE = profile.write.chunk_size;
+  constexpr size_t OUT_CHUNK_SIZE = sizeof(uint64_t);
+
+  // Huffman is only used when smaller than the raw chunk, so a block never
+  // needs more than the chunk itself, + 2 for the last partial word and the
+  // slack of the encoder unaligned stores
+  size_t out_buffer_s = CHUNK_SIZE / OUT_CHUNK_SIZE + 2;
 
-  std::vector<std::shared_ptr<out_segment_info<uint64_t>>> out_segments;
+  int worker_n;
+  size_t out_buffer_n;
+  __plan_memory(CHUNK_SIZE, out_buffer_s * OUT_CHUNK_SIZE,
+                profile.write.worker_n, worker_n, out_buffer_n);
+
+  std::deque<std::shared_ptr<out_segment_info<uint64_t>>> out_segments;
   std::mutex out_segments_m;
   std::condition_variable out_segments_cv;
 
-  LoadDispatcher<char> dispatcher(0, CHUNK_SIZE);
+  // One pool per NUMA node, whose buffers are first touched on the node, so
+  // a worker encodes from and into memory of its own node
+  std::vector<std::unique_ptr<BufferPool<uint64_t>>> out_pools;
+  for (int node = 0; node < placement.node_n(); node++) {
+    size_t capacity = std::max<size_t>(1, out_buffer_n / placement.node_n());
+    if (!placement.enabled()) {
+      out_pools.push_back(
+          std::make_unique<BufferPool<uint64_t>>(capacity, out_buffer_s));
+      continue;
+    }
+    auto cpus = placement.node_cpus[node];
+    out_pools.push_back(std::make_unique<BufferPool<uint64_t>>(
+        capacity, out_buffer_s,
+        [cpus](size_t n) { return allocate_on<uint64_t>(cpus, n); }));
+  }
+  write_stats stats;
+  LoadDispatcher<char> dispatcher(0, CHUNK_SIZE, worker_n, &placement);
 
   istream->seekg(0);
 
@@ -279,39 +1130,59 @@ template <typename T> void Compressor<T>::__write_parallelized() {
   flusher_w->run(Compressor<T>::__write_out<uint64_t>, ostream, &out_segments,
                  &out_segments_m, &out_segments_cv);
 
-  int tot_size = 0;
-  while (istream->peek() != EOF) {
+  // An empty input still gets one empty block so the writer sees a last one
+  bool last = false;
+  // Last byte of the previous block, the context of the first symbol
+  T prev = 0;
+  // Order 0 blocks hand their table over to the next one
+  bool adaptive = adaptive_tables && model.type == MODEL_ORDER0;
+  table_future current_table;
+  if (adaptive) {
+    table_promise first_table;
+    first_table.set_value(__file_table());
+    current_table = first_table.get_future().share();
+  }
+  while (!last) {
     auto worker = dispatcher.request_worker();
-    auto prev_g = istream->tellg();
-    auto metadata = __seek_cut(worker->get_buffer(), CHUNK_SIZE);
-    DEBUG("Size : " << metadata.first
-                    << " Expected out size : " << metadata.second / 8);
-    // + 1 becasue we handle the case where we can't achieve multiple of
-    // OUT_CHUNK_SIZE
-    auto out_buf = std::make_shared<uint64_t[]>(metadata.second / 8 + 1);
+    auto out_pool = out_pools[std::max(worker->node, 0)].get();
+    // Blocks while too many chunks are waiting to be written
+    auto out_buf = out_pool->acquire();
+    istream->read(worker->get_buffer().get(), CHUNK_SIZE);
+    auto n = istream->gcount();
+    DEBUG("Block size : " << n);
+    Telemetry::add_read(n);
 
     // Create nex segment metadata
     auto bob = std::shared_ptr<out_segment_info<uint64_t>>(
         new out_segment_info<uint64_t>);
     bob->available = false;
     bob->data = out_buf;
-    bob->last = istream->eof();
+    bob->pool = out_pool;
+    bob->last = last = istream->peek() == EOF;
 
     // Append new sgement info to segments list
     out_segments_m.lock();
     out_segments.push_back(bob);
+    Telemetry::set_queue_depth(out_segments.size());
     out_segments_m.unlock();
 
-    // Run translator on the segment
-    worker->run(Compressor::__translate<uint64_t>, metadata.first,
-                worker->get_buffer(), out_buf, size_dict, word_dict,
+    // Run encoder on the segment
+    auto next_table = std::make_shared<table_promise>();
+    worker->run(Compressor::__encode_block<uint64_t>, n, worker->get_buffer(),
+                out_buf, &model, prev, current_table, next_table, &stats,
                 &out_segments_m, &out_segments_cv, bob);
-
-    // Seek to the right position
-    istream->seekg((int)prev_g + metadata.first);
-    tot_size += metadata.second / 8;
+    if (adaptive)
+      current_table = next_table->get_future().share();
+    if (n)
+      prev = worker->get_buffer()[n - 1];
   }
   dispatcher.join();
+
+  for (size_t i = 0; i < written_counts.size(); i++) {
+    written_counts[i] = stats.counts[i].load();
+    header_table_counts[i] = stats.header_table_counts[i].load();
+  }
+  written_size = stats.size.load();
 }
 
 
@@ -321,64 +1192,72 @@ template <typename T> void Compressor<T>::__compute_frequency_single_threaded()
   T c;
   size_t n = 100000;
   auto buffer = std::make_unique<char[]>(n);
+  // Same first context as the parallel pass and the writer
+  std::make_unsigned_t<T> prev = 0;
+  if (model.type == MODEL_ORDER1)
+    pair_counts.assign(CONTEXT_N, {0});
   while (!istream->eof()) {
     istream->read(buffer.get(), n);
     auto count = istream->gcount();
+    Telemetry::add_read(count);
     std::for_each_n(buffer.get(), count,
                     [this](char &c) { this->frequency[c]++; });
+    if (model.type != MODEL_ORDER1)
+      continue;
+    auto bytes = (std::make_unsigned_t<T> *)buffer.get();
+    for (std::streamsize i = 0; i < count; i++) {
+      pair_counts[prev][bytes[i]]++;
+      prev = bytes[i];
+    }
   }
 
   istream->clear();
 }
 
+/*
+The blocks of __write_parallelized, encoded one after the other : stored,
+constant or huffman as __choose_block decides, always with the header tables.
+*/
 template <typename T> void Compressor<T>::__write_single_thread() {
+  const size_t CHUNK_SIZE = profile.write.chunk_size;
+  auto in_buffer = std::make_unique<T[]>(CHUNK_SIZE);
+  // The encoder stores whole words : 8 bytes of slack past a full chunk
+  auto out_buffer = std::make_unique<T[]>(CHUNK_SIZE + sizeof(uint64_t));
+  T prev = 0;
 
-  // Rewind
   istream->seekg(0);
-  T c;
-
-  size_t offset = 0;
-
-  uint64_t buffer = 0;
-
-  constexpr size_t buffer_bits_n = sizeof(buffer) * 8;
-
-  while (istream->peek() != EOF) {
-    c = istream->get();
-    auto encoding = dictionnary[c];
-    auto phrase = encoding.first;
-    auto len = encoding.second;
-
-    if (offset + len >= buffer_bits_n) {
-      // Fill gap with first bits
-      size_t gap_len = buffer_bits_n - offset;
-      buffer |= static_cast<decltype(buffer)>(phrase) << offset;
-      offset = buffer_bits_n;
-
-      // Flush
-      __flush_buffer(offset, buffer);
-
-      // Set the remaining bits as first bits
-      buffer = static_cast<decltype(buffer)>(phrase) >> gap_len;
-      offset = len - gap_len;
-    } else {
-      buffer |= static_cast<decltype(buffer)>(phrase) << offset;
-      offset += len;
+  // An empty input still gets one empty block, as the parallel writer does
+  do {
+    istream->read(in_buffer.get(), CHUNK_SIZE);
+    size_t n = istream->gcount();
+    Telemetry::add_read(n);
+    auto in = in_buffer.get();
+
+    std::array<int64_t, UCHAR_MAX + 1> counts = {0};
+    std::for_each_n((std::make_unsigned_t<T> *)in, n,
+                    [&counts](const std::make_unsigned_t<T> c) { counts[c]++; });
+    auto header = __choose_block(counts, n, in, prev, model);
+    write_block_header(*ostream, header);
+
+    switch (header.type) {
+    case BLOCK_STORED:
+      ostream->write(in, n);
+      break;
+    case BLOCK_CONSTANT:
+      ostream->write(in, 1);
+      break;
+    default:
+      encode((const uint8_t *)in, n, (uint8_t)prev,
+             (uint8_t *)out_buffer.get(), model);
+      ostream->write(out_buffer.get(), header.payload_size);
     }
-  }
-  __flush_buffer(offset, buffer);
+    Telemetry::add_written(BLOCK_HEADER_SIZE + header.payload_size);
+    if (n)
+      prev = in[n - 1];
+  } while (istream->peek() != EOF);
+  istream->clear();
 }
 
-template <typename T>
-void inline Compressor<T>::__flush_buffer(size_t length, uint64_t buffer) {
-  if (length == sizeof(buffer) * 8) {
-    ostream->write((const char *)&buffer, length / 8);
-  } else {
-    ostream->write((const char *)&buffer, length / 8 + (length % 8 != 0));
-  }
-};
-
-
 #endif
 
 
@@ -387,6 +1266,7 @@ constexpr size_t WRITER_BUFFER_LENGTH = 4 * 10;
 template <typename T> void Compressor<T>::__write_early_segments() {
   for (auto &segment : segments) {
     ostream->write((const char *)segment.data(), segment.size());
+    Telemetry::add_written(segment.size());
   }
 }
 
@@ -400,15 +1280,55 @@ void print(const std::vector<std::unique_ptr<TreeNode<T>>> &heap) {
 }
 
 template <typename T> void Compressor<T>::__compute_tree() {
+  tree_root = __build_tree(frequency);
+}
+
+/*
+Huffman tree whose codes are at most MAX_CODE_LEN bits, the most a packed
+code table entry holds. Only very skewed histograms, counts in a Fibonacci
+like progression over hundreds of GB, go deeper : their counts are halved,
+present symbols kept at 1 at least, and the tree rebuilt until it fits. Rare
+symbols get shorter codes at a tiny cost for the frequent ones.
+*/
+template <typename T>
+std::unique_ptr<TreeNode<T>>
+Compressor<T>::__build_tree(std::unordered_map<T, int64_t> frequency) {
+  while (true) {
+    auto tree = __build_huffman(frequency);
+    // compute_depth counts the nodes on the longest path, one more than bits
+    if (TreeNode<T>::compute_depth(*tree) - 1 <= (int)MAX_CODE_LEN)
+      return tree;
+    DEBUG("Codes longer than " << MAX_CODE_LEN << " bits : rescaling");
+    for (auto &entry : frequency)
+      if (entry.second)
+        entry.second = std::max<int64_t>(1, entry.second / 2);
+  }
+}
+
+template <typename T>
+std::unique_ptr<TreeNode<T>>
+Compressor<T>::__build_huffman(std::unordered_map<T, int64_t> frequency) {
+
+  // A single symbol would get a zero length code : give it a sibling that
+  // never occurs
+  for (int i = 0; frequency.size() < 2; i++)
+    if (!frequency.count(i))
+      frequency[i] = 0;
 
   std::vector<std::unique_ptr<TreeNode<T>>> heap;
   double count = std::accumulate(
       frequency.begin(), frequency.end(), 0.,
-      [](const int &acc, const auto entry) { return entry.second + acc; });
+      [](double acc, const auto &entry) { return entry.second + acc; });
   for (auto &entry : frequency) {
-    double f = entry.second / count;
+    double f = count ? entry.second / count : 0;
     heap.push_back(std::make_unique<TreeNode<T>>(entry.first, f, false));
   }
+  // The same histogram gives the same tree whatever order the map was filled
+  // in : ties are otherwise broken by the map iteration order
+  std::sort(heap.begin(), heap.end(), [](auto &lhs, auto &rhs) {
+    return (std::make_unsigned_t<T>)lhs->value <
+           (std::make_unsigned_t<T>)rhs->value;
+  });
 
   auto cmp = [](auto &lhs, auto &rhs) {
     return lhs->frequency > rhs->frequency;
@@ -435,11 +1355,68 @@ template <typename T> void Compressor<T>::__compute_tree() {
     std::push_heap(heap.begin(), heap.end(), cmp);
   }
 
-  tree_root = std::move(heap.front());
+  return std::move(heap.front());
 }
 
+/*
+Cluster the contexts and build one tree per group from the summed histograms
+of its contexts.
+*/
+template <typename T> void Compressor<T>::__compute_context_model() {
+  model.context_group = cluster_contexts(pair_counts, MAX_CONTEXT_GROUPS);
+  size_t group_n = *std::max_element(model.context_group.begin(),
+                                     model.context_group.end()) + 1;
+
+  std::vector<std::unordered_map<T, int64_t>> group_frequency(group_n);
+  for (size_t c = 0; c < CONTEXT_N; c++) {
+    for (int s = 0; s <= UCHAR_MAX; s++) {
+      if (pair_counts[c][s])
+        group_frequency[model.context_group[c]][s] += pair_counts[c][s];
+    }
+  }
+
+  // Sampled contexts may see any byte while encoding
+  if (sample_fraction < 1) {
+    for (auto &frequency : group_frequency)
+      for (int s = 0; s <= UCHAR_MAX; s++)
+        frequency[s] = std::max<int64_t>(frequency[s], 1);
+  }
+
+  group_trees.clear();
+  model.tables.assign(group_n, {0});
+  for (size_t g = 0; g < group_n; g++) {
+    group_trees.push_back(__build_tree(group_frequency[g]));
+    collect_codes(*group_trees.back(), model.tables[g]);
+  }
+  model.update_max_code_len();
+
+  INFO("Order 1 model : " << group_n << " context groups");
+}
+
+/*
+ - MODEL_ORDER0 : the tree
+ - MODEL_ORDER1 : the number of groups, the group of every context, then the
+   tree of every group
+*/
 template <typename T> void Compressor<T>::__compute_segments() {
-  segments = serialize(*tree_root, 'x');
+  auto size = reinterpret_cast<const char *>(&input_size);
+  segments = {std::vector<char>(FORMAT_MAGIC,
+                                FORMAT_MAGIC + sizeof(FORMAT_MAGIC)),
+              std::vector<char>(size, size + sizeof(input_size)),
+              {(char)model.type}};
+
+  if (model.type == MODEL_ORDER0) {
+    for (auto &segment : serialize_preorder(*tree_root))
+      segments.push_back(segment);
+    return;
+  }
+
+  segments.push_back({(char)group_trees.size()});
+  segments.push_back(std::vector<char>(model.context_group.begin(),
+                                       model.context_group.end()));
+  for (auto &tree : group_trees)
+    for (auto &segment : serialize_preorder(*tree))
+      segments.push_back(segment);
 }
 
 template <typename T> void Compressor<T>::__compute_dict() { __traversal(); }
@@ -448,16 +1425,20 @@ template <typename T> void Compressor<T>::__traversal() {
   int phrase = 0;
   __backtrack(dictionnary, 0, tree_root, 0);
 
-  // Speed up by turnin map<pair<int,int>> into two int[]
+  // Speed up by turning map<pair<int,int>> into one packed table
+  code_table_t code_table = {0};
   for (auto &r : dictionnary) {
-    word_dict[r.first] = r.second.first;
-    size_dict[r.first] = r.second.second;
+    assert((unsigned)r.second.second <= MAX_CODE_LEN);
+    code_table[(std::make_unsigned_t<T>)r.first] =
+        pack_code(r.second.first, r.second.second);
   }
+  model.tables.assign(1, code_table);
+  model.update_max_code_len();
 }
 
 template <typename T>
-void __backtrack(std::map<T, std::pair<uint32_t, int>> &dict, size_t depth,
-                 std::unique_ptr<TreeNode<T>> &node, uint32_t phrase) {
+void __backtrack(std::map<T, std::pair<uint64_t, int>> &dict, size_t depth,
+                 std::unique_ptr<TreeNode<T>> &node, uint64_t phrase) {
   if (!node->internal) {
     dict[node->value] = std::make_pair(phrase, depth);
     return;
@@ -469,7 +1450,7 @@ void __backtrack(std::map<T, std::pair<uint32_t, int>> &dict, size_t depth,
   }
 
   if (node->right.get() != nullptr) {
-    __backtrack(dict, depth + 1, node->right, phrase + (1 << depth));
+    __backtrack(dict, depth + 1, node->right, phrase + (1ull << depth));
     node->right.release();
   }
 }
\ No newline at end of file
@@ -0,0 +1,148 @@
+#pragma once
+#include "encode_kernel.hpp"
+#include <algorithm>
+#include <array>
+#include <climits>
+#include <cmath>
+#include <numeric>
+#include <vector>
+
+constexpr size_t CONTEXT_N = UCHAR_MAX + 1;
+constexpr size_t MAX_CONTEXT_GROUPS = 16;
+
+/*
+ - MODEL_ORDER0 : a single code table for every symbol
+ - MODEL_ORDER1 : the previous byte selects a context group, every group has
+   its own code table
+*/
+enum model_type : uint8_t { MODEL_ORDER0, MODEL_ORDER1 };
+
+// Histogram of every (previous byte, byte) pair, indexed [context][symbol]
+using pair_counts_t = std::vector<std::array<int64_t, UCHAR_MAX + 1>>;
+
+struct context_model {
+  model_type type = MODEL_ORDER0;
+  std::array<uint8_t, CONTEXT_N> context_group = {0};
+  std::vector<code_table_t> tables;
+  unsigned max_code_len = 0;
+
+  const code_table_t &table(uint8_t prev) const {
+    return tables[context_group[prev]];
+  }
+
+  void update_max_code_len() {
+    max_code_len = 0;
+    for (auto &table : tables)
+      for (auto entry : table)
+        max_code_len = std::max(max_code_len, code_len(entry));
+  }
+};
+
+// Huffman size in bits of `in` with the model, `prev` is the byte before it
+inline size_t model_cost(const uint8_t *in, size_t n, uint8_t prev,
+                         const context_model &model) {
+  size_t bits = 0;
+  for (size_t i = 0; i < n; i++) {
+    bits += code_len(model.table(prev)[in[i]]);
+    prev = in[i];
+  }
+  return bits;
+}
+
+inline size_t encode(const uint8_t *in, size_t n, uint8_t prev, uint8_t *out,
+                     const context_model &model) {
+  if (model.type == MODEL_ORDER0)
+    return encode(in, n, out, model.tables[0], model.max_code_len);
+
+  auto &tables = model.tables;
+  auto &context_group = model.context_group;
+  return encode_dispatch(
+      n, out, model.max_code_len,
+      [in, prev, &tables, &context_group](size_t i) {
+        return tables[context_group[i ? in[i - 1] : prev]][in[i]];
+      });
+}
+
+/*
+Group the contexts whose next byte distributions are alike, so a handful of
+code tables cover the 256 contexts and the header stays small.
+
+The `group_n` busiest contexts seed the groups, then every context moves to
+the group that codes it in the fewest bits and the group histograms are
+recomputed, a few times over. Contexts that never occur join the busiest
+group. Returns the group of every context, group ids are contiguous.
+*/
+inline std::array<uint8_t, CONTEXT_N>
+cluster_contexts(const pair_counts_t &counts, size_t group_n) {
+  constexpr int ITERATIONS = 8;
+  // Additive smoothing : unseen symbols cost a lot but are not forbidden
+  constexpr double ALPHA = 0.5;
+
+  std::array<int64_t, CONTEXT_N> totals;
+  std::vector<int> active;
+  for (size_t c = 0; c < CONTEXT_N; c++) {
+    totals[c] = std::accumulate(counts[c].begin(), counts[c].end(), int64_t(0));
+    if (totals[c])
+      active.push_back(c);
+  }
+  std::sort(active.begin(), active.end(),
+            [&totals](int a, int b) { return totals[a] > totals[b]; });
+
+  std::array<uint8_t, CONTEXT_N> group = {0};
+  group_n = std::max<size_t>(
+      1, std::min({group_n, MAX_CONTEXT_GROUPS, active.size()}));
+
+  for (size_t i = 0; i < active.size(); i++)
+    group[active[i]] = i < group_n ? i : 0;
+
+  std::vector<std::array<double, UCHAR_MAX + 1>> cost(group_n);
+  for (int iteration = 0; iteration < ITERATIONS; iteration++) {
+    // Cost in bits of every symbol in every group
+    std::vector<std::array<int64_t, UCHAR_MAX + 1>> group_counts(group_n);
+    for (auto &g : group_counts)
+      g.fill(0);
+    for (auto c : active)
+      for (int s = 0; s <= UCHAR_MAX; s++)
+        group_counts[group[c]][s] += counts[c][s];
+    for (size_t g = 0; g < group_n; g++) {
+      double total = std::accumulate(group_counts[g].begin(),
+                                     group_counts[g].end(), 0.) +
+                     ALPHA * (UCHAR_MAX + 1);
+      for (int s = 0; s <= UCHAR_MAX; s++)
+        cost[g][s] = -std::log2((group_counts[g][s] + ALPHA) / total);
+    }
+
+    bool moved = false;
+    for (auto c : active) {
+      int best = group[c];
+      double best_cost = INFINITY;
+      for (size_t g = 0; g < group_n; g++) {
+        double bits = 0;
+        for (int s = 0; s <= UCHAR_MAX; s++)
+          bits += counts[c][s] * cost[g][s];
+        if (bits < best_cost) {
+          best_cost = bits;
+          best = g;
+        }
+      }
+      moved = moved || best != group[c];
+      group[c] = best;
+    }
+    if (!moved)
+      break;
+  }
+
+  // Renumber the groups left non empty
+  std::array<int, MAX_CONTEXT_GROUPS> ids;
+  ids.fill(-1);
+  int next_id = 0;
+  for (auto c : active) {
+    if (ids[group[c]] < 0)
+      ids[group[c]] = next_id++;
+  }
+  int busiest = active.empty() ? 0 : ids[group[active[0]]];
+  for (size_t c = 0; c < CONTEXT_N; c++)
+    group[c] = totals[c] ? ids[group[c]] : busiest;
+
+  return group;
+}
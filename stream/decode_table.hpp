@@ -0,0 +1,125 @@
+#pragma once
+#include "../tree/tree.h"
+#include "encode_kernel.hpp"
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+// Code and length of every leaf, the same codes __backtrack gives the encoder
+template <typename T>
+void collect_codes(const TreeNode<T> &node, code_table_t &table,
+                   unsigned depth = 0, uint64_t code = 0) {
+  if (!node.internal) {
+    table[(std::make_unsigned_t<T>)node.value] = pack_code(code, depth);
+    return;
+  }
+  if (node.left)
+    collect_codes(*node.left, table, depth + 1, code);
+  if (node.right)
+    collect_codes(*node.right, table, depth + 1, code | (1ull << depth));
+}
+
+struct decode_entry {
+  // Symbol, or offset of the next table when sub_bits != 0
+  uint32_t value;
+  // Full length of the code
+  uint8_t len;
+  // Bits indexing the next table
+  uint8_t sub_bits;
+};
+
+/*
+Multi level lookup table for a prefix code whose bits are read LSB first.
+The root table is indexed by the next ROOT_BITS bits and resolves every code
+up to that length in one lookup. Longer codes sharing a root prefix go
+through a sub table indexed by the following bits, at most SUB_BITS at a time
+so a very long code never needs a huge table.
+
+The root table is 4 KB, small enough to stay in L1 with a few context tables
+next to it.
+*/
+class DecodeTable {
+public:
+  static constexpr unsigned ROOT_BITS = 9;
+  static constexpr unsigned SUB_BITS = 6;
+
+private:
+  std::vector<decode_entry> entries;
+  unsigned max_len = 0;
+
+  // Fill the table at `offset`, of `bits` index bits, for codes whose first
+  // `shift` bits are `prefix`
+  void _build(const code_table_t &codes, size_t offset, unsigned bits,
+              unsigned shift, uint64_t prefix) {
+    uint64_t prefix_mask = (1ull << shift) - 1;
+    uint64_t index_mask = (1ull << bits) - 1;
+
+    // Longest code behind every index of this table
+    std::vector<unsigned> longest(1 << bits, 0);
+    for (auto entry : codes) {
+      auto len = code_len(entry);
+      auto code = code_bits(entry);
+      if (len <= shift + bits || (code & prefix_mask) != prefix)
+        continue;
+      auto index = (code >> shift) & index_mask;
+      longest[index] = std::max(longest[index], len);
+    }
+
+    for (size_t symbol = 0; symbol < codes.size(); symbol++) {
+      auto len = code_len(codes[symbol]);
+      auto code = code_bits(codes[symbol]);
+      if (!len || len <= shift || len > shift + bits ||
+          (code & prefix_mask) != prefix)
+        continue;
+      for (size_t i = code >> shift; i < (1u << bits); i += 1 << (len - shift))
+        entries[offset + i] = {(uint32_t)symbol, (uint8_t)len, 0};
+    }
+
+    for (size_t index = 0; index < longest.size(); index++) {
+      if (!longest[index])
+        continue;
+      unsigned sub_bits = std::min(longest[index] - shift - bits, SUB_BITS);
+      size_t sub_offset = entries.size();
+      entries[offset + index] = {(uint32_t)sub_offset, 0, (uint8_t)sub_bits};
+      entries.resize(sub_offset + (1 << sub_bits), {0, 0, 0});
+      _build(codes, sub_offset, sub_bits, shift + bits,
+             prefix | (index << shift));
+    }
+  }
+
+public:
+  DecodeTable() = default;
+
+  DecodeTable(const code_table_t &codes) {
+    entries.assign(1 << ROOT_BITS, {0, 0, 0});
+    _build(codes, 0, ROOT_BITS, 0, 0);
+    for (auto entry : codes)
+      max_len = std::max(max_len, code_len(entry));
+  }
+
+  // Longest code, the most bits a lookup consumes
+  unsigned max_code_len() const { return max_len; }
+
+  // `bits` holds the next bits of the stream, LSB first
+  inline decode_entry lookup(uint64_t bits) const {
+    auto entry = entries[bits & ((1 << ROOT_BITS) - 1)];
+    unsigned shift = ROOT_BITS;
+    while (entry.sub_bits) {
+      auto sub_bits = entry.sub_bits;
+      entry = entries[entry.value + ((bits >> shift) & ((1ull << sub_bits) - 1))];
+      shift += sub_bits;
+    }
+    return entry;
+  }
+};
+
+/*
+Next 57 bits at least of an LSB first stream starting at bit `pos`. The
+buffer needs 8 bytes of readable slack past its end.
+*/
+inline uint64_t peek_bits(const uint8_t *in, size_t pos) {
+  uint64_t window;
+  std::memcpy(&window, in + (pos >> 3), sizeof(window));
+  return window >> (pos & 7);
+}
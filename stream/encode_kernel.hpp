@@ -0,0 +1,107 @@
+#pragma once
+#include <array>
+#include <climits>
+#include <cstdint>
+#include <cstring>
+
+/*
+Code and length of every symbol packed in one 64 bits entry so the encoder
+does a single lookup per symbol
+
+---------------------------------
+       code       |   length   |
+---------------------------------
+     56 bits      |   8 bits   |
+---------------------------------
+*/
+using code_table_t = std::array<uint64_t, UCHAR_MAX + 1>;
+
+constexpr unsigned CODE_LEN_BITS = 8;
+constexpr unsigned MAX_CODE_LEN = 64 - CODE_LEN_BITS;
+
+constexpr uint64_t pack_code(uint64_t code, unsigned len) {
+  return (code << CODE_LEN_BITS) | len;
+}
+
+constexpr unsigned code_len(uint64_t entry) {
+  return entry & ((1 << CODE_LEN_BITS) - 1);
+}
+
+constexpr uint64_t code_bits(uint64_t entry) { return entry >> CODE_LEN_BITS; }
+
+/*
+Encode kernel for codes of at most MAX_LEN bits, `lookup(i)` gives the table
+entry of the i-th symbol.
+
+After a flush at most 7 bits are pending in the accumulator, so
+SYMBOLS_PER_FLUSH = 56 / MAX_LEN codes always fit in the 64 bits accumulator
+without checking. Flushes are unconditional unaligned 8 bytes stores followed
+by an advance of the number of complete bytes, which is what makes the loop
+branch free. The output needs 8 bytes of slack past the encoded size.
+
+Bits are emitted LSB first, the same stream as a uint64_t buffer written on a
+little endian machine.
+*/
+template <unsigned MAX_LEN, typename Lookup>
+size_t encode_kernel(size_t n, uint8_t *out, const Lookup &lookup) {
+  static_assert(MAX_LEN > 0 && MAX_LEN <= MAX_CODE_LEN);
+  constexpr unsigned SYMBOLS_PER_FLUSH = MAX_CODE_LEN / MAX_LEN;
+
+  uint64_t acc = 0;
+  unsigned bits = 0;
+  auto begin = out;
+
+  auto flush = [&]() {
+    std::memcpy(out, &acc, sizeof(acc));
+    out += bits >> 3;
+    acc >>= bits & ~7u;
+    bits &= 7;
+  };
+
+  size_t i = 0;
+  for (; i + SYMBOLS_PER_FLUSH <= n; i += SYMBOLS_PER_FLUSH) {
+#pragma GCC unroll 8
+    for (unsigned k = 0; k < SYMBOLS_PER_FLUSH; k++) {
+      auto entry = lookup(i + k);
+      acc |= code_bits(entry) << bits;
+      bits += code_len(entry);
+    }
+    flush();
+  }
+
+  for (; i < n; i++) {
+    auto entry = lookup(i);
+    acc |= code_bits(entry) << bits;
+    bits += code_len(entry);
+    flush();
+  }
+
+  // Last partial byte
+  if (bits)
+    std::memcpy(out, &acc, 1);
+
+  return (out - begin) + (bits != 0);
+}
+
+// Pick the kernel with the most symbols per flush for this code length
+template <typename Lookup>
+size_t encode_dispatch(size_t n, uint8_t *out, unsigned max_len,
+                       const Lookup &lookup) {
+  if (max_len <= 8)
+    return encode_kernel<8>(n, out, lookup);
+  if (max_len <= 11)
+    return encode_kernel<11>(n, out, lookup);
+  if (max_len <= 14)
+    return encode_kernel<14>(n, out, lookup);
+  if (max_len <= 18)
+    return encode_kernel<18>(n, out, lookup);
+  if (max_len <= 28)
+    return encode_kernel<28>(n, out, lookup);
+  return encode_kernel<MAX_CODE_LEN>(n, out, lookup);
+}
+
+inline size_t encode(const uint8_t *in, size_t n, uint8_t *out,
+                     const code_table_t &table, unsigned max_len) {
+  return encode_dispatch(n, out, max_len,
+                         [in, &table](size_t i) { return table[in[i]]; });
+}
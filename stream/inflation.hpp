@@ -1,10 +1,72 @@
 #pragma once
+#include "../computing/worker.h"
 #include "../tree/tree.h"
+#include "../utils/config.h"
+#include "../utils/perf_counters.hpp"
+#include "../utils/telemetry.hpp"
+#include "context_model.hpp"
+#include "decode_table.hpp"
 #include "serializer.hpp"
 #include "transformer.hpp"
 #include <bitset>
 #include <cassert>
+#include <cstring>
 #include <memory>
+#include <vector>
+
+/*
+A range of a legacy bit stream decoded from a guessed symbol boundary.
+
+Decoding from an arbitrary bit gives garbage at first, but Huffman codes
+usually fall back on the true symbol boundaries after a few symbols, from
+there on the output is right. The decoder records where its first symbols
+start so the stitching can find that point.
+*/
+struct legacy_range {
+  // Symbols starting in [begin, end) are decoded
+  size_t begin = 0;
+  size_t end = 0;
+  std::vector<uint8_t> out = {};
+  // Start bit and output index of the first SYNC_SYMBOLS symbols
+  std::vector<std::pair<size_t, size_t>> sync = {};
+  // Start of the first symbol past the range
+  size_t exit = 0;
+  // A bit pattern matched no code
+  bool broken = false;
+
+  static constexpr size_t SYNC_SYMBOLS = 1024;
+};
+
+/*
+Decode the symbols starting in the range. A symbol is only written when at
+least one bit of the stream follows it, as the original bit by bit decoder
+did, `bit_n` is the length of the stream or SIZE_MAX when it goes on past the
+buffer.
+*/
+inline void decode_legacy_range(const DecodeTable *table, const uint8_t *in,
+                                size_t bit_n, legacy_range *range) {
+  PerfScope perf_scope("inflate/legacy/range", (range->end - range->begin) / 8,
+                       current_worker_id);
+  range->out.clear();
+  range->sync.clear();
+  range->broken = false;
+
+  size_t pos = range->begin;
+  while (pos < range->end) {
+    auto entry = table->lookup(peek_bits(in, pos));
+    if (!entry.len) {
+      range->broken = true;
+      break;
+    }
+    if (pos + entry.len >= bit_n)
+      break;
+    if (range->sync.size() < legacy_range::SYNC_SYMBOLS)
+      range->sync.push_back({pos, range->out.size()});
+    range->out.push_back(entry.value);
+    pos += entry.len;
+  }
+  range->exit = pos;
+}
 
 template <typename T> class Inflator : public Transformer<T> {
   using Transformer<T>::istream;
@@ -13,28 +75,451 @@ template <typename T> class Inflator : public Transformer<T> {
   std::unique_ptr<TreeNode<T>> tree;
   TreeNode<T> *current_node;
 
+  model_type type;
+  std::array<uint8_t, CONTEXT_N> context_group = {0};
+  // For order 0 tables[0] is the current table, BLOCK_HUFFMAN_TABLE blocks
+  // replace it and the blocks after them reuse it
+  std::vector<DecodeTable> tables;
+  // Last byte written, the context of the next block
+  uint8_t prev = 0;
+
+  // Scratch buffers reused across blocks
+  std::vector<T> in_buffer;
+  std::vector<T> out_buffer;
+
+  // Legacy files are decoded on every core by default
+  int worker_n = std::max(1u, std::thread::hardware_concurrency());
+  // Empty unless workers are pinned to the NUMA nodes
+  NumaPlacement placement;
+
   void _advance(bool bit);
+  void _run_legacy();
+  void _run_legacy_serial();
+  bool _run_legacy_parallel();
+  size_t _stitch_legacy(const DecodeTable &table, const uint8_t *in,
+                        size_t bit_n, size_t pos, legacy_range &range);
+  bool _read_model();
+  bool _inflate_stored(const block_header &header);
+  bool _inflate_constant(const block_header &header);
+  bool _inflate_huffman(const block_header &header);
+  template <typename Lookup>
+  static bool _decode_symbols(const uint8_t *in, size_t end, size_t &pos,
+                              uint8_t *out, size_t n, unsigned max_len,
+                              uint8_t context, const Lookup &lookup);
 
 public:
   Inflator(std::shared_ptr<std::basic_istream<T>> s) : Transformer<T>(s){};
   Inflator() = default;
 
+  void set_worker_n(int n) { worker_n = n; }
+  void set_numa(bool numa) {
+    placement = numa ? NumaPlacement(read_topology()) : NumaPlacement();
+  }
+
   void run() override {
-    tree = std::move(deserialize(istream));
-    current_node = tree.get();
-    while (istream->peek() != EOF) {
-      auto c = istream->get();
-      std::bitset<8> bits(c);
-      for (size_t i = 0; i < 8; ++i) {
-        _advance(bits[i]);
+    istream->seekg(0, std::ios::end);
+    uint64_t file_size = istream->tellg();
+    Telemetry::begin_phase("decode", file_size);
+    istream->seekg(0);
+
+    switch (read_magic(*istream)) {
+    case FORMAT_LEGACY:
+      PERF_STAGE("inflate/legacy", 0, _run_legacy())
+      return;
+    case FORMAT_OUTDATED:
+      INFO("Unsupported format version, recompress the original file");
+      return;
+    case FORMAT_CURRENT:
+      break;
+    }
+
+    uint64_t original_size = read_u64(*istream);
+    if (!_read_model()) {
+      INFO("Corrupt header : decoding stopped");
+      return;
+    }
+
+    uint64_t inflated_size = 0;
+    block_header header;
+    while (read_block_header(*istream, header)) {
+      // Sizes are checked before anything is allocated for them : a payload
+      // within the file, a block no larger than any writer cuts, and no more
+      // symbols than payload bits for huffman blocks
+      bool huffman = header.type == BLOCK_HUFFMAN ||
+                     header.type == BLOCK_HUFFMAN_TABLE;
+      bool ok = header.payload_size <= file_size - istream->tellg() &&
+                header.raw_size <= original_size - inflated_size &&
+                header.raw_size <= MAX_BLOCK_SIZE &&
+                (!huffman || header.raw_size <= header.payload_size * 8);
+      if (!ok) {
+        INFO("Corrupt block header ending at byte " << istream->tellg()
+                                                    << " : decoding stopped");
+        return;
+      }
+      inflated_size += header.raw_size;
+      Telemetry::add_read(BLOCK_HEADER_SIZE + header.payload_size);
+      Telemetry::add_written(header.raw_size);
+      switch (header.type) {
+      case BLOCK_STORED:
+        PERF_STAGE("inflate/stored", header.raw_size,
+                   ok = _inflate_stored(header))
+        break;
+      case BLOCK_CONSTANT:
+        PERF_STAGE("inflate/constant", header.raw_size,
+                   ok = _inflate_constant(header))
+        break;
+      case BLOCK_HUFFMAN:
+      case BLOCK_HUFFMAN_TABLE:
+        PERF_STAGE("inflate/huffman", header.raw_size,
+                   ok = _inflate_huffman(header))
+        break;
+      default:
+        ok = false;
+      }
+      if (!ok) {
+        INFO("Corrupt block ending at byte " << istream->tellg()
+                                             << " : decoding stopped");
+        return;
       }
     }
+
+    if (inflated_size != original_size) {
+      INFO("Truncated input : " << inflated_size << " of " << original_size
+                                << " bytes inflated");
+    }
   }
 };
 
+/*
+Files written before blocks existed : a single bit stream up to EOF.
+They have no index, so the parallel decoder guesses where symbols start and
+checks the guess, see legacy_range.
+*/
+template <typename T> void Inflator<T>::_run_legacy() {
+  tree = std::move(deserialize(istream));
+  if (!tree) {
+    INFO("Corrupt legacy header : decoding stopped");
+    return;
+  }
+  current_node = tree.get();
+
+#ifdef PARALLELIZATION
+  if (_run_legacy_parallel())
+    return;
+#endif
+  _run_legacy_serial();
+}
+
+template <typename T> void Inflator<T>::_run_legacy_serial() {
+  while (istream->peek() != EOF) {
+    auto c = istream->get();
+    Telemetry::add_read(1);
+    std::bitset<8> bits(c);
+    for (size_t i = 0; i < 8; ++i) {
+      _advance(bits[i]);
+    }
+  }
+}
+
+// Mirror of Compressor::__compute_segments, false on a corrupt header
+template <typename T> bool Inflator<T>::_read_model() {
+  T byte = 0;
+  istream->read(&byte, 1);
+  type = (model_type)byte;
+
+  std::vector<std::unique_ptr<TreeNode<T>>> trees;
+  if (type == MODEL_ORDER0) {
+    trees.push_back(deserialize_preorder(istream, MAX_CODE_LEN));
+  } else if (type == MODEL_ORDER1) {
+    istream->read(&byte, 1);
+    size_t group_n = (uint8_t)byte;
+    if (!group_n || group_n > MAX_CONTEXT_GROUPS)
+      return false;
+    istream->read((T *)context_group.data(), context_group.size());
+    for (auto group : context_group)
+      if (group >= group_n)
+        return false;
+    for (size_t g = 0; g < group_n; g++)
+      trees.push_back(deserialize_preorder(istream, MAX_CODE_LEN));
+  } else {
+    return false;
+  }
+
+  for (auto &tree : trees) {
+    if (!tree)
+      return false;
+    code_table_t codes = {0};
+    collect_codes(*tree, codes);
+    tables.emplace_back(codes);
+  }
+  return true;
+}
+
+/*
+The stream is read by windows of LEGACY_WINDOW bytes. The bits of a window,
+from the first symbol left over by the previous one, are split in one range
+per worker and every range is decoded from its first bit :
+
+-------------------------------------------------------
+  range 0         |  range 1         |  range 2        |
+-------------------------------------------------------
+  ^ true start       ^ guessed start    ^ guessed start
+
+Range 0 starts on a symbol boundary. The ranges are then stitched in order,
+each from where the previous one really ended, see _stitch_legacy.
+
+Returns false when the tree cannot be decoded with a table, the caller then
+falls back to the serial decoder.
+*/
+template <typename T> bool Inflator<T>::_run_legacy_parallel() {
+  constexpr size_t LEGACY_WINDOW = 64 << 20;
+  // Below this a range is not worth a thread
+  constexpr size_t MIN_RANGE_BITS = 1 << 20;
+  constexpr size_t SLACK = sizeof(uint64_t);
+
+  if (!tree->internal)
+    return false;
+  code_table_t codes = {0};
+  collect_codes(*tree, codes);
+  unsigned max_len = 0;
+  for (auto entry : codes)
+    max_len = std::max(max_len, code_len(entry));
+  // peek_bits gives 57 bits at least
+  if (max_len > MAX_CODE_LEN)
+    return false;
+  DecodeTable table(codes);
+
+  std::vector<legacy_range> ranges(worker_n);
+  std::vector<uint8_t> window;
+  // First bit of the next symbol in the window
+  size_t pos = 0;
+  bool last = false;
+
+  while (!last) {
+    // Keep the bytes of the symbol left over, then fill the window
+    size_t kept = window.empty() ? 0 : window.size() - SLACK - (pos >> 3);
+    if (kept)
+      std::memmove(window.data(), window.data() + (pos >> 3), kept);
+    pos &= 7;
+    window.resize(LEGACY_WINDOW + SLACK);
+    istream->read((T *)window.data() + kept, LEGACY_WINDOW - kept);
+    size_t n = kept + istream->gcount();
+    Telemetry::add_read(istream->gcount());
+    window.resize(n + SLACK);
+    std::memset(window.data() + n, 0, SLACK);
+    last = istream->peek() == EOF;
+
+    // A symbol starting before `limit` is fully in the window
+    size_t bit_n = last ? n * 8 : SIZE_MAX;
+    size_t limit = last ? n * 8 : (n - SLACK) * 8;
+    if (limit <= pos)
+      continue;
+
+    size_t range_n = std::clamp<size_t>((limit - pos) / MIN_RANGE_BITS, 1,
+                                        ranges.size());
+    size_t range_bits = (limit - pos) / range_n;
+
+    LoadDispatcher<char> dispatcher(0, 0, range_n, &placement);
+    for (size_t k = 0; k < range_n; k++) {
+      auto &range = ranges[k];
+      range.begin = pos + k * range_bits;
+      range.end = k + 1 == range_n ? limit : range.begin + range_bits;
+      auto worker = dispatcher.request_worker();
+      worker->run(decode_legacy_range, &table, (const uint8_t *)window.data(),
+                  bit_n, &range);
+    }
+    dispatcher.join();
+
+    for (size_t k = 0; k < range_n; k++) {
+      pos = _stitch_legacy(table, window.data(), bit_n, pos, ranges[k]);
+      if (pos == SIZE_MAX) {
+        INFO("Legacy stream : invalid code, decoding stopped");
+        return true;
+      }
+    }
+  }
+  return true;
+}
+
+/*
+Write the symbols of `range` given that the true symbol boundary at its
+start is `pos`, and return the true boundary at its end.
+
+The true decode is stepped from `pos` until it lands on a boundary of the
+speculative decode. From there both decodes are the same symbols and the
+speculative output is reused. When they do not meet within the recorded
+symbols the rest of the range is decoded serially.
+
+Returns SIZE_MAX when the stream holds an invalid code.
+*/
+template <typename T>
+size_t Inflator<T>::_stitch_legacy(const DecodeTable &table, const uint8_t *in,
+                                   size_t bit_n, size_t pos,
+                                   legacy_range &range) {
+  out_buffer.clear();
+  size_t j = 0;
+  while (pos < range.end && !range.broken) {
+    while (j < range.sync.size() && range.sync[j].first < pos)
+      j++;
+    if (j == range.sync.size())
+      break;
+    if (range.sync[j].first == pos) {
+      ostream->write(out_buffer.data(), out_buffer.size());
+      ostream->write((const T *)range.out.data() + range.sync[j].second,
+                     range.out.size() - range.sync[j].second);
+      Telemetry::add_written(out_buffer.size() + range.out.size() -
+                             range.sync[j].second);
+      return range.exit;
+    }
+    auto entry = table.lookup(peek_bits(in, pos));
+    if (!entry.len || pos + entry.len >= bit_n)
+      break;
+    out_buffer.push_back(entry.value);
+    pos += entry.len;
+  }
+  ostream->write(out_buffer.data(), out_buffer.size());
+
+  DEBUG("Legacy stream : no resynchronization at bit " << range.begin);
+  legacy_range serial = {pos, range.end};
+  decode_legacy_range(&table, in, bit_n, &serial);
+  ostream->write((const T *)serial.out.data(), serial.out.size());
+  Telemetry::add_written(out_buffer.size() + serial.out.size());
+  return serial.broken ? SIZE_MAX : serial.exit;
+}
+
+// The payload is the block itself, false when the sizes disagree
+template <typename T>
+bool Inflator<T>::_inflate_stored(const block_header &header) {
+  if (header.payload_size != header.raw_size)
+    return false;
+  in_buffer.resize(header.payload_size);
+  istream->read(in_buffer.data(), header.payload_size);
+  if ((uint64_t)istream->gcount() != header.payload_size)
+    return false;
+  ostream->write(in_buffer.data(), header.raw_size);
+  if (header.raw_size)
+    prev = in_buffer[header.raw_size - 1];
+  return true;
+}
+
+/*
+The payload is the single byte repeated, false otherwise. Written in pieces of
+at most FILL_SIZE bytes : a 1 byte payload must not allocate a whole block.
+*/
+template <typename T>
+bool Inflator<T>::_inflate_constant(const block_header &header) {
+  constexpr size_t FILL_SIZE = 64 * 1024;
+  T value;
+  if (header.payload_size != 1 || !istream->read(&value, 1))
+    return false;
+  out_buffer.assign(std::min<uint64_t>(header.raw_size, FILL_SIZE), value);
+  for (uint64_t left = header.raw_size; left;) {
+    size_t n = std::min<uint64_t>(left, out_buffer.size());
+    ostream->write(out_buffer.data(), n);
+    left -= n;
+  }
+  prev = value;
+  return true;
+}
+
+/*
+Decode `n` symbols starting at bit `pos`, left past the last one. `end` is the
+bit size of the payload, which has 8 bytes of slack : a run of symbols that
+cannot take `pos` past `end` reads nothing outside of it, so runs go without
+bound checks and their codes are checked once per run. `context` is the byte
+before the first symbol. False on an invalid code or a stream running past
+`end`.
+*/
+template <typename T>
+template <typename Lookup>
+bool Inflator<T>::_decode_symbols(const uint8_t *in, size_t end, size_t &pos,
+                                  uint8_t *out, size_t n, unsigned max_len,
+                                  uint8_t context, const Lookup &lookup) {
+  max_len = std::max(max_len, 1u);
+  for (size_t i = 0; i < n;) {
+    if (pos > end)
+      return false;
+    size_t run = std::min(n - i, (end - pos) / max_len + 1);
+    bool invalid = false;
+    for (size_t k = 0; k < run; k++, i++) {
+      auto entry = lookup(peek_bits(in, pos), context);
+      invalid |= !entry.len;
+      out[i] = context = entry.value;
+      pos += entry.len;
+    }
+    if (invalid)
+      return false;
+  }
+  return pos <= end;
+}
+
+/*
+One table lookup per symbol. The payload gets 8 zero bytes of slack so
+peek_bits can always load a full word. False on a corrupt block.
+*/
+template <typename T>
+bool Inflator<T>::_inflate_huffman(const block_header &header) {
+  in_buffer.resize((size_t)header.payload_size + sizeof(uint64_t));
+  istream->read(in_buffer.data(), header.payload_size);
+  if ((uint64_t)istream->gcount() != header.payload_size)
+    return false;
+  std::memset(in_buffer.data() + header.payload_size, 0, sizeof(uint64_t));
+  out_buffer.resize(header.raw_size);
+
+  auto in = reinterpret_cast<const uint8_t *>(in_buffer.data());
+  auto out = reinterpret_cast<uint8_t *>(out_buffer.data());
+  size_t pos = 0;
+  size_t end = (size_t)header.payload_size * 8;
+
+  if (header.type == BLOCK_HUFFMAN_TABLE) {
+    uint64_t tree_size;
+    if (header.payload_size < sizeof(tree_size))
+      return false;
+    std::memcpy(&tree_size, in, sizeof(tree_size));
+    if (tree_size > header.payload_size - sizeof(tree_size))
+      return false;
+    std::vector<char> tree_data(in + sizeof(tree_size),
+                                in + sizeof(tree_size) + tree_size);
+    auto tree = TreeNode<T>::inflate_preorder(tree_data, MAX_CODE_LEN);
+    if (!tree)
+      return false;
+    code_table_t codes = {0};
+    collect_codes(*tree, codes);
+    tables[0] = DecodeTable(codes);
+    pos = (sizeof(tree_size) + tree_size) * 8;
+  }
+
+  bool ok;
+  if (type == MODEL_ORDER0) {
+    auto &table = tables[0];
+    ok = _decode_symbols(
+        in, end, pos, out, header.raw_size, table.max_code_len(), prev,
+        [&table](uint64_t bits, uint8_t) { return table.lookup(bits); });
+  } else {
+    unsigned max_len = 0;
+    for (auto &table : tables)
+      max_len = std::max(max_len, table.max_code_len());
+    auto &tables = this->tables;
+    auto &context_group = this->context_group;
+    ok = _decode_symbols(in, end, pos, out, header.raw_size, max_len, prev,
+                         [&tables, &context_group](uint64_t bits,
+                                                   uint8_t context) {
+                           return tables[context_group[context]].lookup(bits);
+                         });
+  }
+  if (!ok)
+    return false;
+
+  ostream->write(out_buffer.data(), header.raw_size);
+  if (header.raw_size)
+    prev = out[header.raw_size - 1];
+  return true;
+}
+
 template <typename T> void Inflator<T>::_advance(bool bit) {
   if (!current_node->internal) {
     ostream->put(current_node->value);
+    Telemetry::add_written(1);
     current_node = tree.get();
   }
   if (bit) {
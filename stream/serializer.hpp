@@ -1,7 +1,130 @@
 #pragma once
 #include "../tree/tree.h"
+#include <climits>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <istream>
 #include <memory>
+#include <ostream>
+#include <vector>
+
+/*
+Files start with FORMAT_MAGIC and the size of the original input, followed by
+the model (see Compressor::__compute_segments) and a sequence of blocks.
+
+---------------------------------------------------------
+  magic  | original size |    model     |     blocks     |
+---------------------------------------------------------
+ 4 bytes |    8 bytes    | Dynamic size |  Dynamic size  |
+---------------------------------------------------------
+
+Files written before blocks existed start directly with the flattened tree :
+their first 4 bytes are a flattened tree size, always 2 * (2^depth - 1), which
+can never be equal to the magic.
+*/
+constexpr char FORMAT_MAGIC[4] = {'H', 'F', 'Z', '2'};
+
+/*
+ - FORMAT_LEGACY : no magic, a single bit stream
+ - FORMAT_OUTDATED : the magic of an earlier block format with 32 bits sizes
+ - FORMAT_CURRENT : FORMAT_MAGIC
+*/
+enum format_version { FORMAT_LEGACY, FORMAT_OUTDATED, FORMAT_CURRENT };
+
+/*
+The layout of a block is the following
+
+---------------------------------------------------------
+  type  |  raw size  | payload size |      payload      |
+---------------------------------------------------------
+ 1 byte |  8 bytes   |   8 bytes    |   payload size    |
+---------------------------------------------------------
+
+ - BLOCK_STORED : payload is the raw bytes
+ - BLOCK_CONSTANT : payload is the single byte repeated raw size times
+ - BLOCK_HUFFMAN : payload is the huffman bit stream, padded to a byte, coded
+   with the current table
+ - BLOCK_HUFFMAN_TABLE : payload is a tree (see serialize_preorder) followed by
+   the bit stream coded with it, the tree becomes the current table
+
+The current table is the tree of the header until a BLOCK_HUFFMAN_TABLE
+replaces it.
+*/
+enum block_type : uint8_t {
+  BLOCK_STORED,
+  BLOCK_CONSTANT,
+  BLOCK_HUFFMAN,
+  BLOCK_HUFFMAN_TABLE
+};
+
+struct block_header {
+  block_type type;
+  uint64_t raw_size;
+  uint64_t payload_size;
+};
+
+constexpr size_t BLOCK_HEADER_SIZE =
+    sizeof(block_header::type) + sizeof(block_header::raw_size) +
+    sizeof(block_header::payload_size);
+
+// Largest raw size of a block : writers cut their blocks under it, decoders
+// reject larger ones before allocating anything
+constexpr uint64_t MAX_BLOCK_SIZE = 1ull << 30;
+
+template <typename T>
+void write_block_header(std::basic_ostream<T> &ostream,
+                        const block_header &header) {
+  char raw[BLOCK_HEADER_SIZE];
+  raw[0] = header.type;
+  std::memcpy(raw + 1, &header.raw_size, sizeof(header.raw_size));
+  std::memcpy(raw + 1 + sizeof(header.raw_size), &header.payload_size,
+              sizeof(header.payload_size));
+  ostream.write(raw, BLOCK_HEADER_SIZE);
+}
+
+// Returns false once the end of the stream is reached
+template <typename T>
+bool read_block_header(std::basic_istream<T> &istream, block_header &header) {
+  char raw[BLOCK_HEADER_SIZE];
+  istream.read(raw, BLOCK_HEADER_SIZE);
+  if (istream.gcount() != BLOCK_HEADER_SIZE)
+    return false;
+  header.type = static_cast<block_type>(raw[0]);
+  std::memcpy(&header.raw_size, raw + 1, sizeof(header.raw_size));
+  std::memcpy(&header.payload_size, raw + 1 + sizeof(header.raw_size),
+              sizeof(header.payload_size));
+  return true;
+}
+
+// Consumes the magic if present, otherwise leaves the stream untouched
+template <typename T>
+format_version read_magic(std::basic_istream<T> &istream) {
+  char magic[sizeof(FORMAT_MAGIC)];
+  auto start = istream.tellg();
+  istream.read(magic, sizeof(magic));
+  if (istream.gcount() == sizeof(magic)) {
+    if (std::memcmp(magic, FORMAT_MAGIC, sizeof(magic)) == 0)
+      return FORMAT_CURRENT;
+    // Only the version differs
+    if (std::memcmp(magic, FORMAT_MAGIC, sizeof(magic) - 1) == 0)
+      return FORMAT_OUTDATED;
+  }
+  istream.clear();
+  istream.seekg(start);
+  return FORMAT_LEGACY;
+}
+
+template <typename T>
+void write_u64(std::basic_ostream<T> &ostream, uint64_t value) {
+  ostream.write(reinterpret_cast<const char *>(&value), sizeof(value));
+}
+
+template <typename T> uint64_t read_u64(std::basic_istream<T> &istream) {
+  uint64_t value = 0;
+  istream.read(reinterpret_cast<char *>(&value), sizeof(value));
+  return value;
+}
 
 /*
 The layout of the memory is the following
@@ -41,19 +164,104 @@ template <typename T>
 std::unique_ptr<TreeNode<T>>
 deserialize(std::shared_ptr<std::basic_istream<T>> istream) {
 
-  // Compute size of the flattened tree
-  int32_t tree_segment_size;
+  // Compute size of the flattened tree, written as an int32 by the writer
+  int32_t tree_segment_size = 0;
   istream->read(reinterpret_cast<char *>(&tree_segment_size),
                 sizeof(tree_segment_size));
+  if (istream->gcount() != sizeof(tree_segment_size) ||
+      tree_segment_size <= 0 ||
+      tree_segment_size % sizeof(_TreeNode<T>) != 0)
+    return nullptr;
+
+  // The tree lies within the file : nothing larger than it is allocated
+  auto tree_begin = istream->tellg();
+  istream->seekg(0, std::ios::end);
+  auto file_end = istream->tellg();
+  istream->seekg(tree_begin);
+  if (file_end - tree_begin < tree_segment_size)
+    return nullptr;
 
-  auto tmp_buffer = new char[tree_segment_size];
+  std::vector<char> tmp_buffer(tree_segment_size);
 
-  istream->read(tmp_buffer, tree_segment_size);
+  istream->read(tmp_buffer.data(), tree_segment_size);
+  if (istream->gcount() != tree_segment_size)
+    return nullptr;
+
+  // Each node is a value then its empty flag, which must be a valid bool
+  for (size_t i = offsetof(_TreeNode<T>, empty); i < tmp_buffer.size();
+       i += sizeof(_TreeNode<T>))
+    if ((uint8_t)tmp_buffer[i] > 1)
+      return nullptr;
   std::vector<_TreeNode<T>> flattened_tree(
-      reinterpret_cast<_TreeNode<T> *>(tmp_buffer),
-      reinterpret_cast<_TreeNode<T> *>(tmp_buffer + tree_segment_size));
-  std::cout << tree_segment_size << std::endl;
-  std::cout << flattened_tree.size() << std::endl;
+      reinterpret_cast<_TreeNode<T> *>(tmp_buffer.data()),
+      reinterpret_cast<_TreeNode<T> *>(tmp_buffer.data() + tree_segment_size));
+
+  // Decoding walks from the root to a leaf : the root and every internal
+  // node reached must have both children
+  if (!flattened_tree[0].empty)
+    return nullptr;
+  std::vector<size_t> pending = {0};
+  while (!pending.empty()) {
+    size_t i = pending.back();
+    pending.pop_back();
+    if (!flattened_tree[i].empty)
+      continue;
+    if (2 * (i + 1) >= flattened_tree.size())
+      return nullptr;
+    pending.push_back(2 * i + 1);
+    pending.push_back(2 * (i + 1));
+  }
 
   return TreeNode<T>::inflate(flattened_tree);
-}
\ No newline at end of file
+}
+
+/*
+Same layout as serialize, with the tree in pre order : its size is linear in
+the number of symbols where the flattened tree grows with 2^depth.
+
+---------------------------------------------
+         1st segment        |   2nd segment  |
+---------------------------------------------
+   size of the tree data    |    Tree data   |
+---------------------------------------------
+          8 bytes           |  Dynamic size  |
+---------------------------------------------
+*/
+template <typename T>
+std::vector<std::vector<char>> serialize_preorder(TreeNode<T> &root) {
+  std::vector<std::vector<char>> segments;
+  auto tree_segment = TreeNode<T>::preorder(root);
+
+  std::vector<char> size_segment;
+  uint64_t size = tree_segment.size();
+  auto size_d = (char *)&size;
+  size_segment.insert(size_segment.end(), size_d, size_d + sizeof(size));
+
+  segments.push_back(size_segment);
+  segments.push_back(tree_segment);
+
+  return segments;
+}
+
+// Bytes serialize_preorder writes for a tree of `leaf_n` leaves
+constexpr size_t preorder_size(size_t leaf_n) {
+  // 1 byte per internal node, 2 per leaf
+  return sizeof(uint64_t) + (leaf_n - 1) + 2 * leaf_n;
+}
+
+template <typename T>
+std::unique_ptr<TreeNode<T>>
+deserialize_preorder(std::shared_ptr<std::basic_istream<T>> istream,
+                     size_t max_depth = SIZE_MAX) {
+  uint64_t tree_segment_size = read_u64(*istream);
+  // A whole tree of byte leaves : 256 leaves and 255 internal nodes at most
+  if (tree_segment_size > 3 * (UCHAR_MAX + 1))
+    return nullptr;
+
+  std::vector<char> tree_segment(tree_segment_size);
+  istream->read(tree_segment.data(), tree_segment_size);
+  if ((uint64_t)istream->gcount() != tree_segment_size)
+    return nullptr;
+
+  return TreeNode<T>::inflate_preorder(tree_segment, max_depth);
+}
@@ -1,7 +1,11 @@
 #pragma once
 
+#include <cmath>
+#include <cstdint>
 #include <functional>
+#include <memory>
 #include <type_traits>
+#include <vector>
 
 template <typename T> struct _TreeNode {
   T value;
@@ -95,4 +99,59 @@ public:
 
     return node;
   }
+
+  /*
+  Compact layout, linear in the number of nodes : nodes in pre order, 1 for an
+  internal node, 0 followed by the value for a leaf
+  */
+  static std::vector<char> preorder(TreeNode &root) {
+    std::vector<char> data;
+    root._preorder(data);
+    return data;
+  }
+
+  void _preorder(std::vector<char> &data) {
+    if (!internal) {
+      data.push_back(0);
+      data.push_back(value);
+      return;
+    }
+    data.push_back(1);
+    left->_preorder(data);
+    right->_preorder(data);
+  }
+
+  /*
+  Inverse of preorder. Returns nullptr unless `data` is exactly one tree whose
+  leaves are at most `max_depth` deep.
+  */
+  static std::unique_ptr<TreeNode>
+  inflate_preorder(const std::vector<char> &data,
+                   size_t max_depth = SIZE_MAX) {
+    size_t i = 0;
+    auto root = _inflate_preorder(data, i, 0, max_depth);
+    if (i != data.size())
+      return nullptr;
+    return root;
+  }
+
+  static std::unique_ptr<TreeNode>
+  _inflate_preorder(const std::vector<char> &data, size_t &i, size_t depth,
+                    size_t max_depth) {
+    if (i >= data.size() || depth > max_depth)
+      return nullptr;
+    if (!data[i++]) {
+      if (i >= data.size())
+        return nullptr;
+      return std::make_unique<TreeNode>(data[i++], 0, false);
+    }
+    auto node = std::make_unique<TreeNode>(T(), 0, true);
+    node->left = _inflate_preorder(data, i, depth + 1, max_depth);
+    if (!node->left)
+      return nullptr;
+    node->right = _inflate_preorder(data, i, depth + 1, max_depth);
+    if (!node->right)
+      return nullptr;
+    return node;
+  }
 };
\ No newline at end of file
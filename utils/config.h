@@ -0,0 +1,10 @@
+#pragma once
+
+/*
+Build wide switches, included by every header that depends on them so a
+translation unit sees the same configuration whatever it includes first.
+
+PARALLELIZATION : compress and decompress with worker threads. Comment it out
+for a single-threaded build.
+*/
+#define PARALLELIZATION
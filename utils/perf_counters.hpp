@@ -0,0 +1,254 @@
+#pragma once
+#include "log.h"
+#include <array>
+#include <cstdint>
+#include <cstring>
+#include <iomanip>
+#include <map>
+#include <mutex>
+#include <string>
+
+#ifdef __linux__
+#include <linux/perf_event.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+/*
+Hardware counters collected per stage and per worker with perf_event_open.
+Collection is off unless PerfRegistry::enable() is called, and counters the
+kernel refuses (missing PMU, perf_event_paranoid, VMs) are left out of the
+report.
+*/
+
+struct perf_counter_def {
+  const char *name;
+  uint32_t type;
+  uint64_t config;
+};
+
+#ifdef __linux__
+constexpr uint64_t cache_miss_config(uint64_t cache) {
+  return cache | (PERF_COUNT_HW_CACHE_OP_READ << 8) |
+         (PERF_COUNT_HW_CACHE_RESULT_MISS << 16);
+}
+
+constexpr std::array<perf_counter_def, 6> PERF_COUNTERS = {{
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-misses", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1D-misses", PERF_TYPE_HW_CACHE,
+     cache_miss_config(PERF_COUNT_HW_CACHE_L1D)},
+    {"LLC-misses", PERF_TYPE_HW_CACHE,
+     cache_miss_config(PERF_COUNT_HW_CACHE_LL)},
+    {"ctx-switches", PERF_TYPE_SOFTWARE, PERF_COUNT_SW_CONTEXT_SWITCHES},
+}};
+#else
+constexpr std::array<perf_counter_def, 0> PERF_COUNTERS = {};
+#endif
+
+enum perf_counter_id {
+  PERF_CYCLES,
+  PERF_INSTRUCTIONS,
+  PERF_BRANCH_MISSES,
+  PERF_L1D_MISSES,
+  PERF_LLC_MISSES,
+  PERF_CTX_SWITCHES,
+  PERF_COUNTER_N
+};
+
+struct perf_totals {
+  std::array<uint64_t, PERF_COUNTER_N> values = {0};
+  std::array<bool, PERF_COUNTER_N> valid = {false};
+  uint64_t bytes = 0;
+
+  void add(const perf_totals &other) {
+    for (int i = 0; i < PERF_COUNTER_N; i++) {
+      values[i] += other.values[i];
+      valid[i] = valid[i] || other.valid[i];
+    }
+    bytes += other.bytes;
+  }
+};
+
+class PerfRegistry {
+  static inline bool enabled = false;
+  static inline std::mutex m;
+  // stage -> worker id (-1 for the calling thread) -> totals
+  static inline std::map<std::string, std::map<int, perf_totals>> stages;
+
+public:
+  static void enable() { enabled = true; }
+  static bool is_enabled() { return enabled; }
+
+  static void record(const std::string &stage, int worker,
+                     const perf_totals &totals) {
+    std::unique_lock lk(m);
+    stages[stage][worker].add(totals);
+  }
+
+  static void print_row(const std::string &stage, const std::string &thread,
+                        const perf_totals &t) {
+    std::cout << GREEN << "[PERF] " << RESET << std::left << std::setw(20)
+              << stage << std::setw(10) << thread << std::right
+              << std::setw(14) << t.bytes << " B";
+    if (t.valid[PERF_CYCLES] && t.valid[PERF_INSTRUCTIONS] &&
+        t.values[PERF_CYCLES])
+      std::cout << " | IPC " << std::fixed << std::setprecision(2)
+                << (double)t.values[PERF_INSTRUCTIONS] / t.values[PERF_CYCLES];
+    if (t.valid[PERF_CYCLES] && t.bytes)
+      std::cout << " | cycles/B " << std::fixed << std::setprecision(2)
+                << (double)t.values[PERF_CYCLES] / t.bytes;
+    for (auto i : {PERF_BRANCH_MISSES, PERF_L1D_MISSES, PERF_LLC_MISSES}) {
+      if (t.valid[i] && t.bytes)
+        std::cout << " | " << PERF_COUNTERS[i].name << "/B " << std::fixed
+                  << std::setprecision(4) << (double)t.values[i] / t.bytes;
+    }
+    if (t.valid[PERF_CTX_SWITCHES])
+      std::cout << " | " << PERF_COUNTERS[PERF_CTX_SWITCHES].name << " "
+                << t.values[PERF_CTX_SWITCHES];
+    std::cout << std::defaultfloat << std::endl;
+  }
+
+  static void report() {
+    if (!enabled)
+      return;
+    std::unique_lock lk(m);
+    for (auto &stage : stages) {
+      perf_totals total;
+      for (auto &thread : stage.second)
+        total.add(thread.second);
+      print_row(stage.first, "total", total);
+      if (stage.second.size() < 2)
+        continue;
+      for (auto &thread : stage.second)
+        print_row("", thread.first < 0 ? "main"
+                                       : "w" + std::to_string(thread.first),
+                  thread.second);
+    }
+  }
+};
+
+/*
+Counts the calling thread from construction to destruction and adds the
+result to `stage`.
+
+The counters are opened as one group led by cycles, so they are scheduled on
+the PMU together and every ratio compares counts over the same time. When
+there are more groups than hardware counters the kernel multiplexes them : the
+counts are scaled by the time the group was enabled over the time it actually
+ran. A counter that cannot join the group (the leader failed to open, or the
+PMU cannot fit it) is opened as a group of its own and scaled alike.
+*/
+class PerfScope {
+  std::string stage;
+  int worker;
+  uint64_t bytes;
+  std::array<int, PERF_COUNTER_N> fds;
+  // Counter leading the group of each counter, -1 when not opened
+  std::array<int, PERF_COUNTER_N> leaders;
+
+#ifdef __linux__
+  static int _open(size_t i, int group_fd) {
+    perf_event_attr attr;
+    std::memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = PERF_COUNTERS[i].type;
+    attr.config = PERF_COUNTERS[i].config;
+    attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED |
+                       PERF_FORMAT_TOTAL_TIME_RUNNING;
+    // Members follow their leader, which is enabled last
+    attr.disabled = group_fd < 0;
+    // Software events such as context switches happen in the kernel
+    attr.exclude_kernel = PERF_COUNTERS[i].type != PERF_TYPE_SOFTWARE;
+    attr.exclude_hv = 1;
+    // This thread only, on any cpu
+    return syscall(SYS_perf_event_open, &attr, 0, -1, group_fd, 0);
+  }
+
+  // Read the group led by counter `leader` into `totals`
+  void _read_group(size_t leader, perf_totals &totals) const {
+    // nr, time enabled, time running, then one value per counter
+    std::array<uint64_t, 3 + PERF_COUNTER_N> group;
+    auto size = read(fds[leader], group.data(), sizeof(group));
+    if (size < (ssize_t)(3 * sizeof(uint64_t)))
+      return;
+    uint64_t nr = group[0], enabled = group[1], running = group[2];
+    // Never on the PMU : no count to scale
+    if (!running || size < (ssize_t)((3 + nr) * sizeof(uint64_t)))
+      return;
+    double scale = (double)enabled / running;
+    // Members were opened, hence are read, in counter order
+    size_t k = 0;
+    for (size_t i = 0; i < PERF_COUNTERS.size() && k < nr; i++) {
+      if (leaders[i] != (int)leader)
+        continue;
+      totals.values[i] = group[3 + k++] * scale;
+      totals.valid[i] = true;
+    }
+  }
+#endif
+
+public:
+  PerfScope(const std::string &stage, uint64_t bytes, int worker = -1)
+      : stage(stage), worker(worker), bytes(bytes) {
+    fds.fill(-1);
+    leaders.fill(-1);
+    if (!PerfRegistry::is_enabled())
+      return;
+#ifdef __linux__
+    int leader = -1;
+    for (size_t i = 0; i < PERF_COUNTERS.size(); i++) {
+      if (leader >= 0) {
+        fds[i] = _open(i, fds[leader]);
+        if (fds[i] >= 0) {
+          leaders[i] = leader;
+          continue;
+        }
+      }
+      fds[i] = _open(i, -1);
+      if (fds[i] < 0)
+        continue;
+      leaders[i] = i;
+      // Cycles lead, or the first counter that opens when they cannot
+      if (leader < 0)
+        leader = i;
+    }
+    for (size_t i = 0; i < PERF_COUNTERS.size(); i++) {
+      if (leaders[i] != (int)i)
+        continue;
+      ioctl(fds[i], PERF_EVENT_IOC_RESET, PERF_IOC_FLAG_GROUP);
+      ioctl(fds[i], PERF_EVENT_IOC_ENABLE, PERF_IOC_FLAG_GROUP);
+    }
+#endif
+  }
+
+  void set_bytes(uint64_t n) { bytes = n; }
+
+  ~PerfScope() {
+    if (!PerfRegistry::is_enabled())
+      return;
+    perf_totals totals;
+    totals.bytes = bytes;
+#ifdef __linux__
+    for (size_t i = 0; i < PERF_COUNTERS.size(); i++)
+      if (leaders[i] == (int)i)
+        ioctl(fds[i], PERF_EVENT_IOC_DISABLE, PERF_IOC_FLAG_GROUP);
+    for (size_t i = 0; i < PERF_COUNTERS.size(); i++)
+      if (leaders[i] == (int)i)
+        _read_group(i, totals);
+    // Members before their leader
+    for (size_t i = PERF_COUNTERS.size(); i-- > 0;)
+      if (fds[i] >= 0)
+        close(fds[i]);
+#endif
+    PerfRegistry::record(stage, worker, totals);
+  }
+};
+
+#define PERF_STAGE(stage, bytes, expr)                                         \
+  {                                                                            \
+    PerfScope _perf_scope(stage, bytes);                                       \
+    expr;                                                                      \
+  }
@@ -0,0 +1,272 @@
+#pragma once
+#include "log.h"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+
+#ifdef __linux__
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+/*
+Live progress of the running job, in the Prometheus text format. Stages feed
+the counters as they go, a publisher thread samples them every interval to
+compute the throughput and publishes them :
+ - by rewriting a stats file, atomically through a rename
+ - on a Unix domain socket, every connection gets the current metrics and is
+   closed, e.g. `socat - UNIX-CONNECT:path`
+Nothing runs unless Telemetry::start() is called, the counters are then a few
+relaxed atomic adds per chunk.
+
+Progress is tracked per phase (histogram, encode, decode...) : the ETA is the
+time left in the current phase at the current throughput.
+*/
+class Telemetry {
+  static inline std::atomic<bool> enabled = false;
+
+  static inline std::atomic<uint64_t> bytes_read = 0;
+  static inline std::atomic<uint64_t> bytes_written = 0;
+  static inline std::atomic<uint64_t> phase_read = 0;
+  static inline std::atomic<uint64_t> phase_written = 0;
+  static inline std::atomic<uint64_t> phase_expected = 0;
+  static inline std::atomic<int64_t> queue_depth = 0;
+  static inline std::atomic<int64_t> active_workers = 0;
+
+  static inline std::mutex m;
+  static inline std::condition_variable cv;
+  static inline bool stopping = false;
+  static inline std::thread publisher;
+  static inline std::string phase = "idle";
+  static inline std::string stats_path;
+  static inline std::string socket_path;
+  static inline std::chrono::milliseconds interval{1000};
+  static inline std::chrono::steady_clock::time_point started;
+  // Throughput over the last interval, in bytes read per second
+  static inline double throughput = 0;
+
+public:
+  static bool is_enabled() { return enabled.load(std::memory_order_relaxed); }
+
+  static void add_read(uint64_t n) {
+    if (!is_enabled())
+      return;
+    bytes_read.fetch_add(n, std::memory_order_relaxed);
+    phase_read.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static void add_written(uint64_t n) {
+    if (!is_enabled())
+      return;
+    bytes_written.fetch_add(n, std::memory_order_relaxed);
+    phase_written.fetch_add(n, std::memory_order_relaxed);
+  }
+
+  static void set_queue_depth(int64_t n) {
+    queue_depth.store(n, std::memory_order_relaxed);
+  }
+
+  static void worker_started() {
+    active_workers.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  static void worker_finished() {
+    active_workers.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+  // `expected` is the number of bytes the phase will read, 0 if unknown
+  static void begin_phase(const std::string &name, uint64_t expected) {
+    std::unique_lock lk(m);
+    phase = name;
+    phase_read = 0;
+    phase_written = 0;
+    phase_expected = expected;
+  }
+
+  static std::string render() {
+    std::unique_lock lk(m);
+    uint64_t read = phase_read, written = phase_written,
+             expected = phase_expected;
+    double elapsed = std::chrono::duration<double>(
+                         std::chrono::steady_clock::now() - started)
+                         .count();
+    double ratio = read ? (double)written / read : NAN;
+    double eta = NAN;
+    if (expected && throughput > 0)
+      eta = (expected > read ? expected - read : 0) / throughput;
+
+    std::ostringstream out;
+    auto metric = [&out](const char *name, const char *type, const char *help,
+                         auto value, const std::string &labels = "") {
+      out << "# HELP " << name << " " << help << "\n";
+      out << "# TYPE " << name << " " << type << "\n";
+      out << name << labels << " " << value << "\n";
+    };
+    metric("hfz_bytes_read_total", "counter", "Bytes read by every phase",
+           bytes_read.load());
+    metric("hfz_bytes_written_total", "counter", "Bytes written by every phase",
+           bytes_written.load());
+    metric("hfz_phase_bytes_read", "gauge", "Bytes read by the current phase",
+           read, "{phase=\"" + phase + "\"}");
+    metric("hfz_phase_bytes_expected", "gauge",
+           "Bytes the current phase will read, 0 if unknown", expected,
+           "{phase=\"" + phase + "\"}");
+    metric("hfz_throughput_bytes_per_second", "gauge",
+           "Bytes read per second over the last interval", throughput);
+    metric("hfz_ratio", "gauge",
+           "Bytes written over bytes read by the current phase", ratio);
+    metric("hfz_queue_depth", "gauge", "Blocks waiting to be written",
+           queue_depth.load());
+    metric("hfz_active_workers", "gauge", "Workers running a task",
+           active_workers.load());
+    metric("hfz_eta_seconds", "gauge", "Time left in the current phase", eta);
+    metric("hfz_elapsed_seconds", "gauge", "Time since the job started",
+           elapsed);
+    return out.str();
+  }
+
+  /*
+  Start publishing to `stats` and / or `socket`, empty paths are skipped, every
+  `interval_ms` milliseconds.
+  */
+  static void start(const std::string &stats, const std::string &socket,
+                    int interval_ms) {
+    stats_path = stats;
+    socket_path = socket;
+    interval = std::chrono::milliseconds(std::max(interval_ms, 1));
+    started = std::chrono::steady_clock::now();
+    stopping = false;
+    enabled = true;
+    publisher = std::thread(_publish);
+  }
+
+  // Publish a last time and stop the publisher thread
+  static void stop() {
+    if (!is_enabled())
+      return;
+    {
+      std::unique_lock lk(m);
+      stopping = true;
+    }
+    cv.notify_all();
+    publisher.join();
+    _write_stats();
+    enabled = false;
+  }
+
+  static void _write_stats() {
+    if (stats_path.empty())
+      return;
+    // Readers never see a half written file
+    auto tmp_path = stats_path + ".tmp";
+    {
+      std::ofstream out(tmp_path, std::ios::trunc);
+      out << render();
+    }
+    if (std::rename(tmp_path.c_str(), stats_path.c_str()) != 0) {
+      INFO("Telemetry : cannot write " << stats_path);
+    }
+  }
+
+  static int _open_socket() {
+#ifdef __linux__
+    if (socket_path.empty())
+      return -1;
+    sockaddr_un addr = {};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+      INFO("Telemetry : socket path too long " << socket_path);
+      return -1;
+    }
+    std::strncpy(addr.sun_path, socket_path.c_str(), sizeof(addr.sun_path) - 1);
+    unlink(socket_path.c_str());
+    int fd = ::socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0 || bind(fd, (sockaddr *)&addr, sizeof(addr)) != 0 ||
+        listen(fd, 4) != 0) {
+      INFO("Telemetry : cannot listen on " << socket_path);
+      if (fd >= 0)
+        close(fd);
+      return -1;
+    }
+    return fd;
+#else
+    return -1;
+#endif
+  }
+
+  static void _serve(int listen_fd, std::chrono::milliseconds timeout) {
+#ifdef __linux__
+    pollfd pfd = {listen_fd, POLLIN, 0};
+    if (poll(&pfd, 1, timeout.count()) <= 0)
+      return;
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0)
+      return;
+    auto text = render();
+    for (size_t sent = 0; sent < text.size();) {
+      // A client gone before the end (EPIPE) only ends its connection : no
+      // SIGPIPE, which would kill the process
+      auto n = send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+      if (n <= 0)
+        break;
+      sent += n;
+    }
+    close(fd);
+#endif
+  }
+
+  static void _publish() {
+    int listen_fd = _open_socket();
+    auto last_tick = std::chrono::steady_clock::now();
+    uint64_t last_read = bytes_read;
+
+    while (true) {
+      auto next_tick = last_tick + interval;
+      // Answer the socket until the next tick
+      while (listen_fd >= 0 && std::chrono::steady_clock::now() < next_tick) {
+        {
+          std::unique_lock lk(m);
+          if (stopping)
+            break;
+        }
+        // Short polls so stop() is not delayed by a whole interval
+        auto left = std::chrono::duration_cast<std::chrono::milliseconds>(
+            next_tick - std::chrono::steady_clock::now());
+        _serve(listen_fd, std::clamp(left, std::chrono::milliseconds(0),
+                                     std::chrono::milliseconds(100)));
+      }
+      {
+        std::unique_lock lk(m);
+        cv.wait_until(lk, next_tick, [] { return stopping; });
+        if (stopping)
+          break;
+        auto now = std::chrono::steady_clock::now();
+        uint64_t read = bytes_read;
+        throughput = (read - last_read) /
+                     std::chrono::duration<double>(now - last_tick).count();
+        last_read = read;
+        last_tick = now;
+      }
+      _write_stats();
+    }
+
+#ifdef __linux__
+    if (listen_fd >= 0) {
+      close(listen_fd);
+      unlink(socket_path.c_str());
+    }
+#endif
+  }
+};